@@ -19,13 +19,21 @@
  */
 #include "onewire.h"
 #include <string.h>
+#if CONFIG_ONEWIRE_RMT
+#include "onewire_rmt.h"
+#endif
 
 #define ONEWIRE_SELECT_ROM 0x55
 #define ONEWIRE_SKIP_ROM   0xcc
 #define ONEWIRE_SEARCH     0xf0
+#define ONEWIRE_ALARM_SEARCH 0xec
 
-static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
-static bool setup_done = false;
+#if !CONFIG_ONEWIRE_RMT
+// Each bus (pin) has its own state so that transactions on different buses
+// can run concurrently without contending for one critical section.
+static portMUX_TYPE mux[GPIO_NUM_MAX] = { [0 ... (GPIO_NUM_MAX - 1)] = portMUX_INITIALIZER_UNLOCKED };
+static portMUX_TYPE setup_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t setup_done = 0;
 
 // Waits up to `max_wait` microseconds for the specified pin to go high.
 // Returns true if successful, false if the bus never comes high (likely
@@ -51,10 +59,11 @@ static void setup_pin(gpio_num_t pin, bool open_drain)
     gpio_config_t io_conf;
     memset(&io_conf, 0, sizeof(gpio_config_t));
     io_conf.mode = open_drain ? GPIO_MODE_INPUT_OUTPUT_OD : GPIO_MODE_OUTPUT;
-    io_conf.pin_bit_mask = (1 << pin);
+    io_conf.pin_bit_mask = (1ULL << pin);
     io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
     gpio_config(&io_conf);
 }
+#endif // !CONFIG_ONEWIRE_RMT
 
 // Perform the onewire reset function.  We will wait up to 250uS for
 // the bus to come high, if it doesn't then it is broken or shorted
@@ -64,9 +73,14 @@ static void setup_pin(gpio_num_t pin, bool open_drain)
 //
 bool onewire_reset(gpio_num_t pin)
 {
-    if (!setup_done) {
+#if CONFIG_ONEWIRE_RMT
+    return onewire_rmt_reset(pin);
+#else
+    if (!(setup_done & (1ULL << pin))) {
         setup_pin(pin, true);
-        setup_done = true;
+        portENTER_CRITICAL(&setup_mux);
+        setup_done |= (1ULL << pin);
+        portEXIT_CRITICAL(&setup_mux);
     }
 
     gpio_set_level(pin, 1);
@@ -77,60 +91,69 @@ bool onewire_reset(gpio_num_t pin)
     gpio_set_level(pin, 0);
     ets_delay_us(480);
 
-    portENTER_CRITICAL(&mux);
+    portENTER_CRITICAL(&mux[pin]);
     gpio_set_level(pin, 1); // allow it to float
     ets_delay_us(70);
     bool r = !gpio_get_level(pin);
-    portEXIT_CRITICAL(&mux);
+    portEXIT_CRITICAL(&mux[pin]);
 
     // Wait for all devices to finish pulling the bus low before returning
     if (!_onewire_wait_for_bus(pin, 410))
         return false;
 
     return r;
+#endif
 }
 
 static bool _onewire_write_bit(gpio_num_t pin, bool v)
 {
+#if CONFIG_ONEWIRE_RMT
+    return onewire_rmt_write_bits(pin, v, 1);
+#else
     if (!_onewire_wait_for_bus(pin, 10))
         return false;
     if (v)
     {
-        portENTER_CRITICAL(&mux);
+        portENTER_CRITICAL(&mux[pin]);
         gpio_set_level(pin, 0);  // drive output low
         ets_delay_us(10);
         gpio_set_level(pin, 1);  // allow output high
-        portEXIT_CRITICAL(&mux);
+        portEXIT_CRITICAL(&mux[pin]);
         ets_delay_us(55);
     }
     else
     {
-        portENTER_CRITICAL(&mux);
+        portENTER_CRITICAL(&mux[pin]);
         gpio_set_level(pin, 0);  // drive output low
         ets_delay_us(65);
         gpio_set_level(pin, 1); // allow output high
-        portEXIT_CRITICAL(&mux);
+        portEXIT_CRITICAL(&mux[pin]);
     }
     ets_delay_us(1);
 
     return true;
+#endif
 }
 
 static int _onewire_read_bit(gpio_num_t pin)
 {
+#if CONFIG_ONEWIRE_RMT
+    return onewire_rmt_read_bits(pin, 1);
+#else
     if (!_onewire_wait_for_bus(pin, 10))
         return -1;
 
-    portENTER_CRITICAL(&mux);
+    portENTER_CRITICAL(&mux[pin]);
     gpio_set_level(pin, 0);
     ets_delay_us(2);
     gpio_set_level(pin, 1);  // let pin float, pull up will raise
     ets_delay_us(11);
     int r = gpio_get_level(pin);  // Must sample within 15us of start
     ets_delay_us(48);
-    portEXIT_CRITICAL(&mux);
+    portEXIT_CRITICAL(&mux[pin]);
 
     return r;
+#endif
 }
 
 // Write a byte. The writing code uses open-drain mode and expects the pullup
@@ -140,11 +163,16 @@ static int _onewire_read_bit(gpio_num_t pin)
 //
 bool onewire_write(gpio_num_t pin, uint8_t v)
 {
+#if CONFIG_ONEWIRE_RMT
+    // the whole byte goes out as one RMT transfer
+    return onewire_rmt_write_bits(pin, v, 8);
+#else
     for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1)
         if (!_onewire_write_bit(pin, (bitMask & v)))
             return false;
 
     return true;
+#endif
 }
 
 bool onewire_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count)
@@ -160,6 +188,9 @@ bool onewire_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count)
 //
 int onewire_read(gpio_num_t pin)
 {
+#if CONFIG_ONEWIRE_RMT
+    return onewire_rmt_read_bits(pin, 8);
+#else
     int r = 0;
 
     for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1)
@@ -171,6 +202,7 @@ int onewire_read(gpio_num_t pin)
             r |= bitMask;
     }
     return r;
+#endif
 }
 
 bool onewire_read_bytes(gpio_num_t pin, uint8_t *buf, size_t count)
@@ -212,6 +244,9 @@ bool onewire_skip_rom(gpio_num_t pin)
 
 bool onewire_power(gpio_num_t pin)
 {
+#if CONFIG_ONEWIRE_RMT
+    return onewire_rmt_power(pin, true);
+#else
     // Make sure the bus is not being held low before driving it high, or we
     // may end up shorting ourselves out.
     if (!_onewire_wait_for_bus(pin, 10))
@@ -221,11 +256,16 @@ bool onewire_power(gpio_num_t pin)
     gpio_set_level(pin, 1);
 
     return true;
+#endif
 }
 
 void onewire_depower(gpio_num_t pin)
 {
+#if CONFIG_ONEWIRE_RMT
+    onewire_rmt_power(pin, false);
+#else
     setup_pin(pin, true);
+#endif
 }
 
 void onewire_search_start(onewire_search_t *search)
@@ -260,7 +300,10 @@ void onewire_search_prefix(onewire_search_t *search, uint8_t family_code)
 // Return 1 : device found, ROM number in ROM_NO buffer
 //        0 : device not found, end of search
 //
-onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin)
+// `command` selects a normal (0xf0) or conditional alarm (0xec) search; only
+// devices with their alarm flag set take part in the latter.
+//
+static onewire_addr_t _onewire_search(onewire_search_t *search, gpio_num_t pin, uint8_t command)
 {
     //TODO: add more checking for read/write errors
     uint8_t id_bit_number;
@@ -291,7 +334,7 @@ onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin)
         }
 
         // issue the search command
-        onewire_write(pin, ONEWIRE_SEARCH);
+        onewire_write(pin, command);
 
         // loop to do the search
         do
@@ -379,6 +422,16 @@ onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin)
     return addr;
 }
 
+onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin)
+{
+    return _onewire_search(search, pin, ONEWIRE_SEARCH);
+}
+
+onewire_addr_t onewire_search_next_alarm(onewire_search_t *search, gpio_num_t pin)
+{
+    return _onewire_search(search, pin, ONEWIRE_ALARM_SEARCH);
+}
+
 // The 1-Wire CRC scheme is described in Maxim Application Note 27:
 // "Understanding and Using Cyclic Redundancy Checks with Maxim iButton Products"
 //
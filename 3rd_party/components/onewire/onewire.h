@@ -208,6 +208,21 @@ void onewire_search_prefix(onewire_search_t *search, uint8_t family_code);
  */
 onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin);
 
+/**
+ * @brief Search for the next device on the bus with its alarm flag set.
+ *
+ * This is the conditional (Alarm Search) form of onewire_search_next(), and
+ * uses the same search state, so start it with onewire_search_start() (or
+ * onewire_search_prefix()). Only devices whose alarm condition was met by
+ * their last operation (e.g. a DS18B20 temperature conversion outside its
+ * TH/TL thresholds) respond, so a single sweep finds every device in alarm.
+ *
+ * @return the address of the next device in alarm, or ::ONEWIRE_NONE if
+ * there is no next address. ::ONEWIRE_NONE is also returned when no device
+ * is in alarm, as well as for the bus errors listed for onewire_search_next().
+ */
+onewire_addr_t onewire_search_next_alarm(onewire_search_t *search, gpio_num_t pin);
+
 /**
  * @brief Compute a Dallas Semiconductor 8 bit CRC.
  *
@@ -0,0 +1,299 @@
+/**
+ * @file onewire_rmt.c
+ *
+ * RMT peripheral backend for the 1-Wire driver.
+ *
+ * Each bus uses a TX channel to generate the slots and an RX channel to
+ * sample the line, both routed to the same open-drain GPIO (the approach used
+ * by several ESP32 1-Wire libraries). The TX channel idles high so the
+ * external pull-up owns the bus between slots. The RX channel sees both our
+ * own drive and the device response, so a read slot is decoded from the
+ * length of the low pulse: the device stretches it past the sample point to
+ * return a 0.
+ */
+#include "sdkconfig.h"
+
+#if CONFIG_ONEWIRE_RMT
+
+#include "onewire_rmt.h"
+#include <string.h>
+#include <driver/rmt.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/ringbuf.h>
+#include <soc/gpio_struct.h>
+#include <soc/io_mux_reg.h>
+#include <esp_log.h>
+
+#define ONEWIRE_RMT_CLK_DIV        80   // 80MHz APB / 80 = 1MHz, 1us per tick
+#define ONEWIRE_RMT_RX_FILTER      30   // APB ticks (375ns) of glitch rejection
+#define ONEWIRE_RMT_RX_BUF_SIZE    512  // ringbuffer bytes for received symbols
+#define ONEWIRE_RMT_RESET_RX_IDLE  (ONEWIRE_RMT_RESET_LOW + 60)
+#define ONEWIRE_RMT_RX_TIMEOUT     pdMS_TO_TICKS(20)
+
+#define ONEWIRE_RMT_MAX_BUSES      ((RMT_CHANNEL_MAX - CONFIG_ONEWIRE_RMT_CHANNEL_BASE) / 2)
+
+static const char *TAG = "onewire_rmt";
+
+typedef enum
+{
+    BUS_UNCONFIGURED,
+    BUS_CONFIGURING,    // claimed by the task installing the channels
+    BUS_READY
+} onewire_rmt_bus_state_t;
+
+typedef struct
+{
+    gpio_num_t pin;
+    rmt_channel_t tx_channel;
+    rmt_channel_t rx_channel;
+    RingbufHandle_t rb;
+    onewire_rmt_bus_state_t state;  // only accessed under buses_mux
+} onewire_rmt_bus_t;
+
+static portMUX_TYPE buses_mux = portMUX_INITIALIZER_UNLOCKED;
+static onewire_rmt_bus_t buses[ONEWIRE_RMT_MAX_BUSES];
+static unsigned int bus_count = 0;
+
+//--------------------------------------------------------------------------
+// Conversion between the driver-independent symbols and RMT items
+
+static void to_items(rmt_item32_t *items, const onewire_rmt_symbol_t *symbols, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        items[i].level0 = symbols[i].level0;
+        items[i].duration0 = symbols[i].duration0;
+        items[i].level1 = symbols[i].level1;
+        items[i].duration1 = symbols[i].duration1;
+    }
+}
+
+static size_t from_items(onewire_rmt_symbol_t *symbols, const rmt_item32_t *items, size_t count)
+{
+    size_t i;
+
+    if (count > ONEWIRE_RMT_RX_MAX_ITEMS)
+        count = ONEWIRE_RMT_RX_MAX_ITEMS;
+    for (i = 0; i < count; i++)
+    {
+        symbols[i].level0 = items[i].level0;
+        symbols[i].duration0 = items[i].duration0;
+        symbols[i].level1 = items[i].level1;
+        symbols[i].duration1 = items[i].duration1;
+    }
+    return count;
+}
+
+//--------------------------------------------------------------------------
+// Channel management
+
+static bool bus_setup(onewire_rmt_bus_t *bus)
+{
+    rmt_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    config.rmt_mode = RMT_MODE_TX;
+    config.channel = bus->tx_channel;
+    config.gpio_num = bus->pin;
+    config.mem_block_num = 1;
+    config.clk_div = ONEWIRE_RMT_CLK_DIV;
+    config.tx_config.loop_en = false;
+    config.tx_config.carrier_en = false;
+    config.tx_config.idle_level = RMT_IDLE_LEVEL_HIGH;
+    config.tx_config.idle_output_en = true;
+    if ((ESP_OK != rmt_config(&config)) || (ESP_OK != rmt_driver_install(bus->tx_channel, 0, 0)))
+        return false;
+
+    memset(&config, 0, sizeof(config));
+    config.rmt_mode = RMT_MODE_RX;
+    config.channel = bus->rx_channel;
+    config.gpio_num = bus->pin;
+    config.mem_block_num = 1;
+    config.clk_div = ONEWIRE_RMT_CLK_DIV;
+    config.rx_config.filter_en = true;
+    config.rx_config.filter_ticks_thresh = ONEWIRE_RMT_RX_FILTER;
+    config.rx_config.idle_threshold = ONEWIRE_RMT_RX_IDLE;
+    if ((ESP_OK != rmt_config(&config)) || (ESP_OK != rmt_driver_install(bus->rx_channel, ONEWIRE_RMT_RX_BUF_SIZE, 0)))
+        return false;
+    if (ESP_OK != rmt_get_ringbuf_handle(bus->rx_channel, &bus->rb))
+        return false;
+
+    // Route both channels to the one pin. The RX route must be set first
+    // since configuring the pin as an output clears its input path, so input
+    // and open-drain are re-enabled directly afterwards.
+    rmt_set_pin(bus->rx_channel, RMT_MODE_RX, bus->pin);
+    rmt_set_pin(bus->tx_channel, RMT_MODE_TX, bus->pin);
+    PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[bus->pin]);
+    GPIO.pin[bus->pin].pad_driver = 1;
+    gpio_set_pull_mode(bus->pin, GPIO_PULLUP_ONLY);
+
+    return true;
+}
+
+// Find or allocate the channels for a pin, installing them on first use. The
+// driver install can block, so it runs outside the lock: the first caller
+// claims the bus and any other caller waits until it is ready.
+static onewire_rmt_bus_t *bus_get(gpio_num_t pin)
+{
+    onewire_rmt_bus_t *bus;
+    onewire_rmt_bus_state_t state;
+    bool ready;
+    unsigned int i;
+
+    for (;;)
+    {
+        bus = NULL;
+        state = BUS_UNCONFIGURED;
+        portENTER_CRITICAL(&buses_mux);
+        for (i = 0; i < bus_count; i++)
+        {
+            if (buses[i].pin == pin)
+            {
+                bus = &buses[i];
+                break;
+            }
+        }
+        if ((NULL == bus) && (bus_count < ONEWIRE_RMT_MAX_BUSES))
+        {
+            bus = &buses[bus_count];
+            bus->pin = pin;
+            bus->tx_channel = (rmt_channel_t)(CONFIG_ONEWIRE_RMT_CHANNEL_BASE + (2 * bus_count));
+            bus->rx_channel = (rmt_channel_t)(bus->tx_channel + 1);
+            bus->state = BUS_UNCONFIGURED;
+            bus_count++;
+        }
+        if (bus)
+        {
+            state = bus->state;
+            if (BUS_UNCONFIGURED == state)
+                bus->state = BUS_CONFIGURING;
+        }
+        portEXIT_CRITICAL(&buses_mux);
+
+        if ((NULL == bus) || (BUS_CONFIGURING != state))
+            break;
+        vTaskDelay(1);
+    }
+
+    if (NULL == bus)
+    {
+        ESP_LOGE(TAG, "No free RMT channels for GPIO %d", pin);
+        return NULL;
+    }
+    if (BUS_READY == state)
+        return bus;
+
+    ready = bus_setup(bus);
+    portENTER_CRITICAL(&buses_mux);
+    bus->state = (ready ? BUS_READY : BUS_UNCONFIGURED);
+    portEXIT_CRITICAL(&buses_mux);
+    if (!ready)
+    {
+        ESP_LOGE(TAG, "Failed to configure RMT channels %d/%d for GPIO %d", bus->tx_channel, bus->rx_channel, pin);
+        return NULL;
+    }
+    return bus;
+}
+
+static void flush_rx(onewire_rmt_bus_t *bus)
+{
+    void *p;
+    size_t size;
+
+    while ((p = xRingbufferReceive(bus->rb, &size, 0)))
+        vRingbufferReturnItem(bus->rb, p);
+}
+
+// Transmit the given symbols while sampling the bus, then decode `nbits` read
+// slots from the received symbols (or a presence pulse when `nbits` is 0).
+static int transceive(onewire_rmt_bus_t *bus, const onewire_rmt_symbol_t *tx, size_t count, unsigned int nbits)
+{
+    rmt_item32_t items[8];
+    onewire_rmt_symbol_t symbols[ONEWIRE_RMT_RX_MAX_ITEMS];
+    rmt_item32_t *rx;
+    size_t size = 0;
+    int r = -1;
+
+    to_items(items, tx, count);
+    flush_rx(bus);
+    rmt_rx_start(bus->rx_channel, true);
+    if (ESP_OK == rmt_write_items(bus->tx_channel, items, count, true))
+    {
+        rx = (rmt_item32_t *)xRingbufferReceive(bus->rb, &size, ONEWIRE_RMT_RX_TIMEOUT);
+        if (rx)
+        {
+            count = from_items(symbols, rx, (size / sizeof(rmt_item32_t)));
+            vRingbufferReturnItem(bus->rb, rx);
+            if (nbits)
+                r = onewire_rmt_decode_bits(symbols, count, nbits);
+            else
+                r = onewire_rmt_decode_presence(symbols, count);
+        }
+    }
+    rmt_rx_stop(bus->rx_channel);
+    return r;
+}
+
+//--------------------------------------------------------------------------
+// Bus operations
+
+bool onewire_rmt_reset(gpio_num_t pin)
+{
+    onewire_rmt_bus_t *bus = bus_get(pin);
+    onewire_rmt_symbol_t items[ONEWIRE_RMT_RESET_ITEMS];
+    int r;
+
+    if (NULL == bus)
+        return false;
+
+    // stay in the frame across the reset pulse and the presence window
+    onewire_rmt_power(pin, false);
+    rmt_set_rx_idle_thresh(bus->rx_channel, ONEWIRE_RMT_RESET_RX_IDLE);
+    r = transceive(bus, items, onewire_rmt_encode_reset(items), 0);
+    rmt_set_rx_idle_thresh(bus->rx_channel, ONEWIRE_RMT_RX_IDLE);
+
+    return (r > 0);
+}
+
+bool onewire_rmt_write_bits(gpio_num_t pin, uint8_t value, unsigned int nbits)
+{
+    onewire_rmt_bus_t *bus = bus_get(pin);
+    onewire_rmt_symbol_t symbols[8];
+    rmt_item32_t items[8];
+    size_t count;
+
+    if ((NULL == bus) || (nbits > 8))
+        return false;
+
+    count = onewire_rmt_encode_bits(symbols, value, nbits);
+    to_items(items, symbols, count);
+    return (ESP_OK == rmt_write_items(bus->tx_channel, items, count, true));
+}
+
+int onewire_rmt_read_bits(gpio_num_t pin, unsigned int nbits)
+{
+    onewire_rmt_bus_t *bus = bus_get(pin);
+    onewire_rmt_symbol_t items[8];
+
+    if ((NULL == bus) || (nbits > 8))
+        return -1;
+
+    return transceive(bus, items, onewire_rmt_encode_bits(items, 0xff, nbits), nbits);
+}
+
+bool onewire_rmt_power(gpio_num_t pin, bool on)
+{
+    onewire_rmt_bus_t *bus = bus_get(pin);
+
+    if (NULL == bus)
+        return false;
+
+    // the TX channel idles high, so dropping open-drain drives the bus high
+    GPIO.pin[pin].pad_driver = (on ? 0 : 1);
+    return true;
+}
+
+#endif  /* CONFIG_ONEWIRE_RMT */
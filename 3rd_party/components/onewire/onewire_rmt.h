@@ -0,0 +1,53 @@
+/**
+ * @file onewire_rmt.h
+ *
+ * RMT peripheral backend for the 1-Wire driver.
+ *
+ * Reset, write and read slots are generated as RMT symbols by a TX channel
+ * and the bus is sampled by an RX channel attached to the same open-drain
+ * pin. A whole byte is a single 8-symbol transfer, so the CPU is free while
+ * the slots are clocked out and interrupts are never disabled for bus timing.
+ *
+ * The slot timings and the symbol encoders and decoders are in
+ * onewire_rmt_symbol.h.
+ */
+#ifndef __ONEWIRE_RMT_H__
+#define __ONEWIRE_RMT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <driver/gpio.h>
+#include "onewire_rmt_symbol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Perform a reset cycle on the bus attached to `pin`.
+ */
+bool onewire_rmt_reset(gpio_num_t pin);
+
+/**
+ * @brief Clock out `nbits` write slots.
+ */
+bool onewire_rmt_write_bits(gpio_num_t pin, uint8_t value, unsigned int nbits);
+
+/**
+ * @brief Clock out `nbits` read slots and sample the bus.
+ *
+ * @return the bits read, or a negative value on error.
+ */
+int onewire_rmt_read_bits(gpio_num_t pin, unsigned int nbits);
+
+/**
+ * @brief Drive the bus actively high (`true`) or return to open-drain.
+ */
+bool onewire_rmt_power(gpio_num_t pin, bool on);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __ONEWIRE_RMT_H__ */
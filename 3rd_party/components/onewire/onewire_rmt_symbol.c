@@ -0,0 +1,87 @@
+/**
+ * @file onewire_rmt_symbol.c
+ *
+ * 1-Wire slot encoding and decoding for the RMT backend. This file only
+ * deals in onewire_rmt_symbol_t so it builds without the RMT driver (see
+ * test_onewire_host).
+ */
+#include "onewire_rmt_symbol.h"
+
+static inline void set_item(onewire_rmt_symbol_t *item, uint8_t level0, uint16_t duration0, uint8_t level1, uint16_t duration1)
+{
+    item->level0 = level0;
+    item->duration0 = duration0;
+    item->level1 = level1;
+    item->duration1 = duration1;
+}
+
+size_t onewire_rmt_encode_reset(onewire_rmt_symbol_t *items)
+{
+    // drive low for the reset pulse, then release for the presence window
+    set_item(&items[0], 0, ONEWIRE_RMT_RESET_LOW, 1, ONEWIRE_RMT_RESET_SAMPLE);
+    set_item(&items[1], 1, ONEWIRE_RMT_RESET_RECOVER, 1, 0);
+    return ONEWIRE_RMT_RESET_ITEMS;
+}
+
+size_t onewire_rmt_encode_bits(onewire_rmt_symbol_t *items, uint8_t value, unsigned int nbits)
+{
+    unsigned int i;
+
+    for (i = 0; i < nbits; i++)
+    {
+        if (value & (1 << i))
+            set_item(&items[i], 0, ONEWIRE_RMT_WRITE1_LOW, 1, ONEWIRE_RMT_WRITE1_HIGH);
+        else
+            set_item(&items[i], 0, ONEWIRE_RMT_WRITE0_LOW, 1, ONEWIRE_RMT_WRITE0_HIGH);
+    }
+    return nbits;
+}
+
+// Walk the received level/duration pairs, calling out each low pulse. The
+// receiver marks the end of a frame with a zero duration.
+static size_t collect_lows(const onewire_rmt_symbol_t *items, size_t count, uint32_t *lows, size_t max)
+{
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; (i < count) && (n < max); i++)
+    {
+        if (0 == items[i].duration0)
+            break;
+        if (0 == items[i].level0)
+            lows[n++] = items[i].duration0;
+        if ((0 == items[i].duration1) || (n == max))
+            break;
+        if (0 == items[i].level1)
+            lows[n++] = items[i].duration1;
+    }
+    return n;
+}
+
+bool onewire_rmt_decode_presence(const onewire_rmt_symbol_t *items, size_t count)
+{
+    uint32_t lows[2];
+    size_t n = collect_lows(items, count, lows, 2);
+
+    // our own reset pulse, followed by a device holding the line low
+    if ((n < 2) || (lows[0] < (ONEWIRE_RMT_RESET_LOW - 2)))
+        return false;
+    return ((lows[1] >= ONEWIRE_RMT_PRESENCE_MIN) && (lows[1] <= ONEWIRE_RMT_PRESENCE_MAX));
+}
+
+int onewire_rmt_decode_bits(const onewire_rmt_symbol_t *items, size_t count, unsigned int nbits)
+{
+    uint32_t lows[8];
+    int r = 0;
+    unsigned int i;
+
+    if ((nbits > 8) || (collect_lows(items, count, lows, nbits) != nbits))
+        return -1;
+
+    for (i = 0; i < nbits; i++)
+    {
+        if (lows[i] <= ONEWIRE_RMT_READ_SAMPLE)
+            r |= (1 << i);
+    }
+    return r;
+}
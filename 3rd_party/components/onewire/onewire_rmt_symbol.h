@@ -0,0 +1,98 @@
+/**
+ * @file onewire_rmt_symbol.h
+ *
+ * 1-Wire slot encoding and decoding for the RMT backend.
+ *
+ * Slots are described as level/duration pairs that mirror the RMT item
+ * layout, but in a local type so this code has no dependency on the RMT
+ * driver and can be built and tested on the host against the 1-Wire timing
+ * spec. The backend converts to and from rmt_item32_t at the driver calls.
+ */
+#ifndef __ONEWIRE_RMT_SYMBOL_H__
+#define __ONEWIRE_RMT_SYMBOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Standard speed slot timings in microseconds (Maxim AN126). The RMT channels
+ * are clocked at 1MHz so one tick is one microsecond.
+ */
+#define ONEWIRE_RMT_TICK_US        1
+#define ONEWIRE_RMT_RESET_LOW      480  ///< H: reset pulse
+#define ONEWIRE_RMT_RESET_SAMPLE   70   ///< I: release to presence sample
+#define ONEWIRE_RMT_RESET_RECOVER  410  ///< J: presence sample to end of the reset cycle
+#define ONEWIRE_RMT_WRITE1_LOW     6    ///< A: write 1 / read initiation
+#define ONEWIRE_RMT_WRITE1_HIGH    64   ///< B: remainder of a 1 (or read) slot
+#define ONEWIRE_RMT_WRITE0_LOW     60   ///< C: write 0
+#define ONEWIRE_RMT_WRITE0_HIGH    10   ///< D: recovery after a 0 slot
+#define ONEWIRE_RMT_READ_SAMPLE    13   ///< A+E less margin: a longer low is a 0
+#define ONEWIRE_RMT_PRESENCE_MIN   40   ///< shortest accepted presence pulse
+#define ONEWIRE_RMT_PRESENCE_MAX   300  ///< longest accepted presence pulse
+#define ONEWIRE_RMT_RX_IDLE        90   ///< RX frame ends after this long high
+
+/** Symbols needed for a reset cycle */
+#define ONEWIRE_RMT_RESET_ITEMS    2
+
+/** Most received symbols examined when decoding */
+#define ONEWIRE_RMT_RX_MAX_ITEMS   16
+
+/**
+ * One symbol: a level held for a duration, then a second level held for a
+ * second duration (in ticks). A zero duration ends a received frame.
+ */
+typedef struct
+{
+    uint16_t duration0;
+    uint8_t level0;
+    uint16_t duration1;
+    uint8_t level1;
+} onewire_rmt_symbol_t;
+
+/**
+ * @brief Encode a reset cycle (reset pulse plus presence window).
+ *
+ * @param[out] items  At least ::ONEWIRE_RMT_RESET_ITEMS symbols.
+ *
+ * @return the number of symbols written.
+ */
+size_t onewire_rmt_encode_reset(onewire_rmt_symbol_t *items);
+
+/**
+ * @brief Encode `nbits` write slots, LSB first.
+ *
+ * Read slots are encoded as writes of 1, so pass 0xff to generate read slots.
+ *
+ * @param[out] items  At least `nbits` symbols.
+ * @param[in]  value  The bits to write.
+ * @param[in]  nbits  Number of slots (1 to 8).
+ *
+ * @return the number of symbols written.
+ */
+size_t onewire_rmt_encode_bits(onewire_rmt_symbol_t *items, uint8_t value, unsigned int nbits);
+
+/**
+ * @brief Decode a received reset cycle.
+ *
+ * @return `true` if a presence pulse followed the reset pulse.
+ */
+bool onewire_rmt_decode_presence(const onewire_rmt_symbol_t *items, size_t count);
+
+/**
+ * @brief Decode `nbits` received read slots, LSB first.
+ *
+ * @return the bits read, or a negative value if the expected number of slots
+ *         was not seen.
+ */
+int onewire_rmt_decode_bits(const onewire_rmt_symbol_t *items, size_t count, unsigned int nbits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __ONEWIRE_RMT_SYMBOL_H__ */
@@ -0,0 +1,171 @@
+/**
+ * @file test_onewire_rmt_symbol.c
+ *
+ * Host test of the RMT backend slot encoding and decoding against the
+ * DS18B20 datasheet timing limits (standard speed, microseconds).
+ */
+#include <stdio.h>
+#include "onewire_rmt_symbol.h"
+
+#define T_RSTL_MIN      480 // reset low
+#define T_RSTH_MIN      480 // release after reset, covering the presence window
+#define T_PDHIGH_MAX    60  // device wait before the presence pulse
+#define T_PDLOW_MIN     60  // presence pulse
+#define T_PDLOW_MAX     240
+#define T_SLOT_MIN      60  // time slot
+#define T_SLOT_MAX      120
+#define T_REC_MIN       1   // recovery between slots
+#define T_LOW0_MIN      60  // write 0 low
+#define T_LOW0_MAX      120
+#define T_LOW1_MIN      1   // write 1 low
+#define T_LOW1_MAX      15
+#define T_RDV           15  // read data valid, from the start of the slot
+#define T_DEV0_MAX      60  // longest a device may hold a 0 read slot low
+
+static unsigned int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void set_item(onewire_rmt_symbol_t *item, uint8_t level0, uint16_t duration0, uint8_t level1, uint16_t duration1)
+{
+    item->level0 = level0;
+    item->duration0 = duration0;
+    item->level1 = level1;
+    item->duration1 = duration1;
+}
+
+//--------------------------------------------------------------------------
+
+static void test_encode_reset(void)
+{
+    onewire_rmt_symbol_t items[ONEWIRE_RMT_RESET_ITEMS];
+    unsigned int high;
+
+    CHECK(ONEWIRE_RMT_RESET_ITEMS == onewire_rmt_encode_reset(items));
+    CHECK((0 == items[0].level0) && (items[0].duration0 >= T_RSTL_MIN));
+
+    // everything after the reset pulse releases the bus
+    CHECK((1 == items[0].level1) && (1 == items[1].level0) && (1 == items[1].level1));
+    high = (items[0].duration1 + items[1].duration0 + items[1].duration1);
+    CHECK(high >= T_RSTH_MIN);
+}
+
+static void test_encode_bits(void)
+{
+    onewire_rmt_symbol_t items[8];
+    unsigned int i;
+
+    CHECK(8 == onewire_rmt_encode_bits(items, 0xa5, 8));
+    for (i = 0; i < 8; i++)
+    {
+        unsigned int slot = (items[i].duration0 + items[i].duration1);
+
+        CHECK((0 == items[i].level0) && (1 == items[i].level1));
+        CHECK((slot >= T_SLOT_MIN) && (slot <= T_SLOT_MAX));
+        CHECK(items[i].duration1 >= T_REC_MIN);
+        if (0xa5 & (1 << i))
+        {
+            // a write 1 (or read) low must end before the device samples
+            CHECK((items[i].duration0 >= T_LOW1_MIN) && (items[i].duration0 <= T_LOW1_MAX));
+            CHECK(items[i].duration0 < ONEWIRE_RMT_READ_SAMPLE);
+        }
+        else
+        {
+            CHECK((items[i].duration0 >= T_LOW0_MIN) && (items[i].duration0 <= T_LOW0_MAX));
+        }
+    }
+
+    CHECK(1 == onewire_rmt_encode_bits(items, 0x00, 1));
+    CHECK(ONEWIRE_RMT_WRITE0_LOW == items[0].duration0);
+}
+
+//--------------------------------------------------------------------------
+
+// A received reset cycle: our reset pulse, the device wait, its presence
+// pulse, then the line high until the receiver times out.
+static bool presence(uint16_t reset_low, uint16_t wait, uint16_t pulse)
+{
+    onewire_rmt_symbol_t rx[3];
+
+    set_item(&rx[0], 0, reset_low, 1, wait);
+    set_item(&rx[1], 0, pulse, 1, 0);
+    set_item(&rx[2], 0, 0, 0, 0);
+    return onewire_rmt_decode_presence(rx, 3);
+}
+
+static void test_decode_presence(void)
+{
+    onewire_rmt_symbol_t rx[2];
+
+    CHECK(presence(T_RSTL_MIN, 15, T_PDLOW_MIN));
+    CHECK(presence(T_RSTL_MIN, T_PDHIGH_MAX, T_PDLOW_MAX));
+    CHECK(presence(T_RSTL_MIN - 2, 30, 120));
+
+    // pulses too short for a device, or longer than one could hold the bus
+    CHECK(!presence(T_RSTL_MIN, 30, ONEWIRE_RMT_PRESENCE_MIN - 1));
+    CHECK(!presence(T_RSTL_MIN, 30, ONEWIRE_RMT_PRESENCE_MAX + 1));
+
+    // a cut short reset pulse is not ours
+    CHECK(!presence(100, 30, 120));
+
+    // nobody on the bus
+    set_item(&rx[0], 0, T_RSTL_MIN, 1, 0);
+    set_item(&rx[1], 0, 0, 0, 0);
+    CHECK(!onewire_rmt_decode_presence(rx, 2));
+    CHECK(!onewire_rmt_decode_presence(rx, 0));
+}
+
+static void test_decode_bits(void)
+{
+    onewire_rmt_symbol_t rx[9];
+    unsigned int i;
+
+    // a 1 is our initiation alone; a 0 is held low past the sample point
+    // by the device, for anything from T_RDV up to T_DEV0_MAX
+    const uint16_t lows[8] = {
+        ONEWIRE_RMT_WRITE1_LOW, T_RDV, ONEWIRE_RMT_READ_SAMPLE, T_DEV0_MAX,
+        T_LOW1_MIN, ONEWIRE_RMT_READ_SAMPLE + 1, ONEWIRE_RMT_WRITE1_LOW, 30,
+    };
+    const int expected = 0x55;
+
+    for (i = 0; i < 8; i++)
+        set_item(&rx[i], 0, lows[i], 1, (70 - lows[i]));
+    rx[7].duration1 = 0;
+    CHECK(expected == onewire_rmt_decode_bits(rx, 8, 8));
+
+    // single read slots, as used by the search
+    set_item(&rx[0], 0, ONEWIRE_RMT_WRITE1_LOW, 1, 0);
+    CHECK(1 == onewire_rmt_decode_bits(rx, 1, 1));
+    set_item(&rx[0], 0, T_RDV, 1, 0);
+    CHECK(0 == onewire_rmt_decode_bits(rx, 1, 1));
+
+    // fewer slots received than expected
+    set_item(&rx[0], 0, ONEWIRE_RMT_WRITE1_LOW, 1, 64);
+    set_item(&rx[1], 0, ONEWIRE_RMT_WRITE1_LOW, 1, 0);
+    CHECK(onewire_rmt_decode_bits(rx, 2, 8) < 0);
+    CHECK(onewire_rmt_decode_bits(rx, 2, 9) < 0);
+}
+
+//--------------------------------------------------------------------------
+
+int main(void)
+{
+    test_encode_reset();
+    test_encode_bits();
+    test_decode_presence();
+    test_decode_bits();
+
+    if (failures)
+    {
+        printf("%u checks failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -5,6 +5,27 @@
    Compatible parts:
    - ADC128S052 8-channel
    - ADC124S021 4-channel
+
+   The fitted part is selected by CONFIG_MLAB_ADC_PART. Every 16-clock frame
+   clocks out the conversion of the channel selected by the previous frame
+   while clocking in the next address, so N channels are scanned as N+1
+   frames in a single SPI transaction, discarding the first result.
+
+   Besides single reads there is a streaming mode for kHz-rate capture. Each
+   sample is a pre-built IN1/IN2 scan transaction, queued from a periodic
+   esp_timer. The result is reaped without blocking when the next scan is
+   due, so no task ever waits on the bus. Samples go into a single-producer (the
+   esp_timer task) single-consumer ring buffer, which the consumer drains in
+   batches. While streaming, single reads return the latest streamed value.
+
+   A quiet hook (e.g. heater_quiet_delay()) can be registered to keep the
+   conversions clear of interference that repeats with a known period, such
+   as PWM switching edges. Each scan, streamed or single, is then held back
+   until the hook reports a window long enough for the whole transaction,
+   without busy-waiting: a single read blocks on a one-shot timer, and the
+   stream re-phases its own timer. Streaming periods are rounded to a
+   multiple of the hook period, so once re-phased later scans land in the
+   window again without any delay.
 */
 
 //=============================================================================
@@ -12,6 +33,11 @@
 #include "adc122s021.h"
 #include <string.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+
 //-----------------------------------------------------------------------------
 
 static const char *p_tag = "adc"; // for esp-idf logging
@@ -25,6 +51,14 @@ static const char *p_tag = "adc"; // for esp-idf logging
 //-----------------------------------------------------------------------------
 /* Unfortunate use of globals, but keeps this code simple at the moment */
 
+// Bytes in a scan of _n channels: one extra frame to clock out the last result
+#define ADC_SCAN_BYTES(_n) (((_n) + 1) * 2)
+
+#define ADC_CLOCK_HZ       (1*1000*1000)
+#define ADC_QUEUE_US       (15) // from the decision to the first clock
+// Time to clock a scan of _n channels, for the quiet hook
+#define ADC_SCAN_US(_n)    (((ADC_SCAN_BYTES(_n) * 8 * 1000000) / ADC_CLOCK_HZ) + ADC_QUEUE_US)
+
 static spi_bus_config_t spi_buscfg = {
     .mosi_io_num = PIN_NUM_MOSI,
     .miso_io_num = PIN_NUM_MISO,
@@ -32,14 +66,19 @@ static spi_bus_config_t spi_buscfg = {
     .quadwp_io_num = -1,
     .quadhd_io_num = -1,
 //    .max_transfer_sz = 4
-    .max_transfer_sz = 8
+    .max_transfer_sz = ADC_SCAN_BYTES(ADC122S021_CHANNELS)
 };
 
+/* The device is shared between the control loop and the cascade inner loop
+   task, and the ADC122S021 returns the channel selected by the previous
+   frame, so each conversion is serialised as a whole. */
+static SemaphoreHandle_t adc_lock = NULL;
+
 static spi_device_interface_config_t spi_devcfg = {
-    .clock_speed_hz = (1*1000*1000), // Clock out at 1MHz
+    .clock_speed_hz = ADC_CLOCK_HZ, // Clock out at 1MHz
     .mode = 0, // SPI mode 0
     .spics_io_num = PIN_NUM_CS, // nCS pin
-    .queue_size = 2 // Number of transactions we wish to queue
+    .queue_size = 1 // Number of transactions we wish to queue (one streamed sample)
 };
 
 //-----------------------------------------------------------------------------
@@ -49,7 +88,12 @@ spi_device_handle_t app_init_spi(void)
     spi_device_handle_t spi = 0;
     esp_err_t ret;
 
-    ESP_LOGD(p_tag,"ADC122S021 initialisation");
+    ESP_LOGD(p_tag,"%s initialisation (%u channels)",ADC122S021_PART,ADC122S021_CHANNELS);
+
+    if (NULL == adc_lock) {
+        adc_lock = xSemaphoreCreateMutex();
+        ESP_ERROR_CHECK((NULL == adc_lock) ? ESP_ERR_NO_MEM : ESP_OK);
+    }
 
     /* NOTE: For a *real* application we would handle the error cases
        explicitly, but for the moment we just use the esp-idf "example" of
@@ -78,51 +122,160 @@ spi_device_handle_t app_init_spi(void)
 
 #define CHANNEL_IN1 (0x0) // Default
 #define CHANNEL_IN2 (0x1)
-// All other channel numbers are "Not Allowed"
+// Channel numbers from ADC122S021_CHANNELS up are "Not Allowed"
+
+// 12-bit conversion from the two bytes clocked out in a frame
+#define ADC_DECODE(_rx)    ((uint16_t)((((_rx)[0] & 0x0F) << 8) | (_rx)[1]))
+// and as the (left-aligned) 32-bit samples returned by the single reads
+#define ADC_ALIGN(_v)      ((uint32_t)(_v) << 20)
+
+#define ADC_STREAM_RING     (512)   // samples buffered, power of two
+#define ADC_STREAM_RATE_MAX (10000) // Hz, leaving the esp_timer task time for others
+#define ADC_STREAM_CHANNELS (2)     // IN1 and IN2
+
+static spi_device_handle_t stream_spi;
+static esp_timer_handle_t stream_timer = NULL;
+static spi_transaction_t stream_trans;
+static WORD_ALIGNED_ATTR uint8_t stream_tx[ADC_SCAN_BYTES(ADC_STREAM_CHANNELS)];
+static WORD_ALIGNED_ATTR uint8_t stream_rx[ADC_SCAN_BYTES(ADC_STREAM_CHANNELS)];
+static bool stream_pending;               // scan queued and not yet reaped
+static int64_t stream_timestamp;          // when the pending scan was queued
+static volatile bool streaming;           // changed with adc_lock held
+static volatile bool stream_stopping;
+static SemaphoreHandle_t stream_stopped = NULL;
+static volatile uint16_t stream_latest[ADC_STREAM_CHANNELS];
+static adc122s021_stream_stats_t stream_stats;
+static uint64_t stream_period_us;
+
+// Attempts at landing a scan in a quiet window, since a timer may fire late
+#define ADC_QUIET_TRIES     (2)
+
+static adc122s021_quiet_t quiet_hook = NULL;
+static uint32_t quiet_period_us;
+static esp_timer_handle_t quiet_timer = NULL; // wakes a single read for its window
+static SemaphoreHandle_t quiet_wake = NULL;
+static adc122s021_quiet_t stream_quiet; // the hook for the running stream
+static unsigned int stream_rephase;     // one-shot attempts at the window so far
+
+static adc122s021_stream_sample_t stream_ring[ADC_STREAM_RING];
+static volatile uint32_t stream_head; // only written by the producer
+static volatile uint32_t stream_tail; // only written by the consumer
 
 //-----------------------------------------------------------------------------
 
-static esp_err_t adc_conversion(spi_device_handle_t spi,uint8_t channel,uint32_t *p_result)
+/* Fill in a scan of count channels: frame i selects p_channels[i] and the
+   trailing frame re-selects the first channel, so a repeated scan starts from
+   the expected address. Results are in frames 1..count. */
+
+static void adc_scan_build(spi_transaction_t *p_t,const uint8_t *p_channels,unsigned int count,uint8_t *p_tx,uint8_t *p_rx)
 {
-    esp_err_t ret = ESP_OK;
-    spi_transaction_t t;
+    unsigned int i;
 
-    memset(&t,'\0',sizeof(t));
+    memset(p_t,'\0',sizeof(*p_t));
+    memset(p_tx,'\0',ADC_SCAN_BYTES(count));
 
-    // assert channel 0 (IN1) or 1 (IN2) .. all other values are undefined
+    for (i = 0; i < count; i++)
+        p_tx[i * 2] = REG_CTRL_ADD(p_channels[i]);
+    p_tx[count * 2] = REG_CTRL_ADD(p_channels[0]);
 
-    /* If we set SPI_TRANS_USE_TXDATA/RXDATA then we have 4-byte tx_data[] and
-       rx_data[] buffers already in the spi_transaction_t structure to avoid a
-       pointer de-reference. */
-    t.flags = (SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA);
-    // TODO:ASCERTAIN: Can we do this (TX and RX in same "transmit()" call?
-    // We may have to do a separate read transaction to get the 2-bytes of ADC data
-    t.length = (8 + 8);// (2 + 2);
-    t.rxlength = 2;
-    t.tx_data[0] = REG_CTRL_ADD(channel);
-//    t.tx_data[0] = 0x20;
-    t.tx_data[1] = 0x00;
-    t.tx_data[2] = 0x00;
-    t.tx_data[3] = 0x00;
-  
+    // full-duplex: each conversion is clocked out while the next address is clocked in
+    p_t->length = (ADC_SCAN_BYTES(count) * 8);
+    p_t->rxlength = 0; // same as length
+    p_t->tx_buffer = p_tx;
+    p_t->rx_buffer = p_rx;
+    p_t->user = NULL;
+}
 
-    t.user = NULL;
+//-----------------------------------------------------------------------------
+
+static void adc_quiet_callback(void *p_arg)
+{
+    (void)p_arg;
+    xSemaphoreGive(quiet_wake);
+}
+
+/* Block until the quiet hook reports a window for a scan of count channels,
+   or give up after ADC_QUIET_TRIES. Called with adc_lock held, so the
+   caller's transaction follows the wake-up directly. */
+
+static void adc_quiet_wait(unsigned int count)
+{
+    unsigned int tries;
+
+    for (tries = 0; tries < ADC_QUIET_TRIES; tries++) {
+        uint32_t delay = quiet_hook(ADC_SCAN_US(count));
+
+        if ((0 == delay) || (delay > quiet_period_us))
+            return;
+        (void)xSemaphoreTake(quiet_wake, 0); // any wake-up from a timed out wait
+        if (ESP_OK != esp_timer_start_once(quiet_timer, delay))
+            return;
+        if (pdTRUE != xSemaphoreTake(quiet_wake, pdMS_TO_TICKS(20))) {
+            (void)esp_timer_stop(quiet_timer);
+            return;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static esp_err_t adc_scan(spi_device_handle_t spi,const uint8_t *p_channels,unsigned int count,uint16_t *p_results)
+{
+    WORD_ALIGNED_ATTR uint8_t tx[ADC_SCAN_BYTES(ADC122S021_CHANNELS)];
+    WORD_ALIGNED_ATTR uint8_t rx[ADC_SCAN_BYTES(ADC122S021_CHANNELS)];
+    esp_err_t ret = ESP_OK;
+    spi_transaction_t t;
+    unsigned int i;
+
+    if ((0 == count) || (count > ADC122S021_CHANNELS))
+        return ESP_ERR_INVALID_ARG;
+    for (i = 0; i < count; i++)
+        if (p_channels[i] >= ADC122S021_CHANNELS)
+            return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(adc_lock,portMAX_DELAY);
+    if (streaming) {
+        // the device belongs to the stream: use its latest samples
+        for (i = 0; (i < count) && (ESP_OK == ret); i++) {
+            if (p_channels[i] < ADC_STREAM_CHANNELS)
+                p_results[i] = stream_latest[p_channels[i]];
+            else
+                ret = ESP_ERR_INVALID_STATE;
+        }
+        xSemaphoreGive(adc_lock);
+        return ret;
+    }
 
-    // mutex lock
+    adc_scan_build(&t,p_channels,count,tx,rx);
+    if (quiet_hook)
+        adc_quiet_wait(count);
     {
         /* For the moment we use the synchronous polling SPI transfer rather
            than doing an interrupt driven transfer. This can be revisited as the
            application requirements are refined. */ 
         ret = spi_device_polling_transmit(spi,&t);
     }
-    // mutex unlock
+    xSemaphoreGive(adc_lock);
+
+    if (ESP_OK == ret) {
+        for (i = 0; i < count; i++)
+            p_results[i] = ADC_DECODE(&rx[(i + 1) * 2]);
+    }
+
+    return ret;
+}
 
-    assert(ESP_OK == ret);
+//-----------------------------------------------------------------------------
 
-    if (p_result) {
-        // uint32_t result = ((t.rx_data[0] << 24) | ((t.rx_data[1] & 0xF) << 20));
-        uint32_t result = (((t.rx_data[0] & 0xF) << 28) | ((t.rx_data[1] & 0xF) << 20));
-        *p_result = result;
+static esp_err_t adc_conversion(spi_device_handle_t spi,uint8_t channel,uint32_t *p_result)
+{
+    esp_err_t ret;
+    uint16_t value;
+
+    // a scan of one, so the result is this channel and not the previous one
+    ret = adc_scan(spi,&channel,1,&value);
+    if ((ESP_OK == ret) && p_result) {
+        *p_result = ADC_ALIGN(value);
     }
 
     return ret;
@@ -159,5 +312,239 @@ esp_err_t adc122s021_read(spi_device_handle_t spi,uint32_t *p_in1,uint32_t *p_in
     return ret;
 }
 
+//-----------------------------------------------------------------------------
+
+esp_err_t adc122s021_sample(spi_device_handle_t spi,unsigned int channel,uint32_t *p_result)
+{
+    if (channel >= ADC122S021_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+
+    return adc_conversion(spi,(uint8_t)channel,p_result);
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t adc122s021_scan(spi_device_handle_t spi,const uint8_t *p_channels,unsigned int count,uint16_t *p_results)
+{
+    if ((NULL == p_channels) || (NULL == p_results))
+        return ESP_ERR_INVALID_ARG;
+
+    return adc_scan(spi,p_channels,count,p_results);
+}
+
+//-----------------------------------------------------------------------------
+/* Streaming producer, on the esp_timer task. The scan queued last period is
+   reaped first. At 1MHz its 48 clocks take about 50us, so it is normally long
+   complete.
+
+   When the quiet hook reports a window later in the period, the periodic
+   timer is swapped for a one-shot at the window and the scan is queued from
+   that callback, which restarts the periodic timer from there. Since the
+   period is a whole number of hook periods the following scans then land in
+   the window too. */
+
+static void adc_stream_callback(void *p_arg)
+{
+    spi_transaction_t *p_t;
+
+    if (stream_pending) {
+        adc122s021_stream_sample_t sample;
+        uint32_t head = stream_head;
+
+        if (ESP_OK != spi_device_get_trans_result(stream_spi, &p_t, (stream_stopping ? portMAX_DELAY : 0))) {
+            stream_stats.overruns++;
+            return;
+        }
+        stream_pending = false;
+
+        sample.timestamp = stream_timestamp;
+        sample.in1 = ADC_DECODE(&stream_rx[2]);
+        sample.in2 = ADC_DECODE(&stream_rx[4]);
+        stream_latest[CHANNEL_IN1] = sample.in1;
+        stream_latest[CHANNEL_IN2] = sample.in2;
+
+        if ((head - stream_tail) >= ADC_STREAM_RING) {
+            stream_stats.dropped++;
+        } else {
+            stream_ring[head & (ADC_STREAM_RING - 1)] = sample;
+            __sync_synchronize(); // publish the sample before the index
+            stream_head = (head + 1);
+            stream_stats.samples++;
+        }
+    }
+
+    if (stream_stopping) {
+        (void)esp_timer_stop(stream_timer);
+        xSemaphoreGive(stream_stopped);
+        return;
+    }
+
+    if (stream_quiet) {
+        uint32_t delay = stream_quiet(ADC_SCAN_US(ADC_STREAM_CHANNELS));
+
+        if ((delay > quiet_period_us) || (delay && (stream_rephase >= ADC_QUIET_TRIES))) {
+            stream_stats.unquiet++;
+        } else if (delay) {
+            // re-phase onto the window, queueing from the one-shot callback
+            if (0 == stream_rephase)
+                stream_stats.delayed++;
+            stream_rephase++;
+            (void)esp_timer_stop(stream_timer);
+            if (ESP_OK == esp_timer_start_once(stream_timer, delay))
+                return;
+            stream_stats.unquiet++;
+        }
+
+        if (stream_rephase) {
+            // after the one-shot, or a failed attempt: periodic from here
+            stream_rephase = 0;
+            (void)esp_timer_stop(stream_timer);
+            (void)esp_timer_start_periodic(stream_timer, stream_period_us);
+        }
+    }
+
+    stream_timestamp = esp_timer_get_time();
+    if (ESP_OK == spi_device_queue_trans(stream_spi, &stream_trans, 0))
+        stream_pending = true;
+    else
+        stream_stats.errors++;
+}
+
+//-----------------------------------------------------------------------------
+
+uint32_t adc122s021_stream_period(uint32_t rate_hz)
+{
+    uint32_t period_us;
+
+    if ((0 == rate_hz) || (rate_hz > ADC_STREAM_RATE_MAX))
+        return 0;
+
+    period_us = (1000000 / rate_hz);
+    if (quiet_hook) {
+        // nearest whole number of hook periods
+        period_us = (((period_us + (quiet_period_us / 2)) / quiet_period_us) * quiet_period_us);
+        if (0 == period_us)
+            period_us = quiet_period_us;
+    }
+    return period_us;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t adc122s021_stream_start(spi_device_handle_t spi,uint32_t rate_hz)
+{
+    static const uint8_t channels[ADC_STREAM_CHANNELS] = { CHANNEL_IN1, CHANNEL_IN2 };
+    esp_err_t ret = ESP_OK;
+
+    if ((0 == rate_hz) || (rate_hz > ADC_STREAM_RATE_MAX))
+        return ESP_ERR_INVALID_ARG;
+    if (streaming)
+        return ESP_ERR_INVALID_STATE;
+
+    if (NULL == stream_timer) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = adc_stream_callback,
+            .name = "adc_stream"
+        };
+        stream_stopped = xSemaphoreCreateBinary();
+        if (NULL == stream_stopped)
+            return ESP_ERR_NO_MEM;
+        ret = esp_timer_create(&timer_args, &stream_timer);
+        if (ESP_OK != ret)
+            return ret;
+    }
+
+    // the scan is built once and re-queued every period
+    adc_scan_build(&stream_trans,channels,ADC_STREAM_CHANNELS,stream_tx,stream_rx);
+
+    xSemaphoreTake(adc_lock,portMAX_DELAY);
+    stream_spi = spi;
+    stream_pending = false;
+    stream_stopping = false;
+    stream_head = 0;
+    stream_tail = 0;
+    memset(&stream_stats,'\0',sizeof(stream_stats));
+    stream_quiet = quiet_hook;
+    stream_rephase = 0;
+    stream_period_us = adc122s021_stream_period(rate_hz);
+    ret = esp_timer_start_periodic(stream_timer, stream_period_us);
+    streaming = (ESP_OK == ret);
+    xSemaphoreGive(adc_lock);
+
+    if (ESP_OK == ret) {
+        ESP_LOGI(p_tag,"Streaming IN1/IN2 every %u us%s",(unsigned int)stream_period_us,(stream_quiet ? " in quiet windows" : ""));
+    } else {
+        ESP_LOGE(p_tag,"Failed to start streaming (%s)",esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+void adc122s021_stream_stop(void)
+{
+    if (!streaming)
+        return;
+
+    // the producer reaps its last pair and stops its own timer
+    stream_stopping = true;
+    if (pdTRUE != xSemaphoreTake(stream_stopped, pdMS_TO_TICKS(100))) {
+        ESP_LOGW(p_tag,"Stream did not stop cleanly");
+        (void)esp_timer_stop(stream_timer);
+    }
+
+    xSemaphoreTake(adc_lock,portMAX_DELAY);
+    streaming = false;
+    xSemaphoreGive(adc_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+size_t adc122s021_stream_read(adc122s021_stream_sample_t *p_samples,size_t max)
+{
+    uint32_t tail = stream_tail;
+    uint32_t available = (stream_head - tail);
+    size_t count = ((available < max) ? available : max);
+    size_t i;
+
+    __sync_synchronize(); // read the samples only after the index
+    for (i = 0; i < count; i++)
+        p_samples[i] = stream_ring[(tail + i) & (ADC_STREAM_RING - 1)];
+    __sync_synchronize(); // finish with the slots before handing them back
+    stream_tail = (tail + count);
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+
+void adc122s021_stream_get_stats(adc122s021_stream_stats_t *p_stats)
+{
+    *p_stats = stream_stats;
+}
+
+//-----------------------------------------------------------------------------
+
+void adc122s021_set_quiet_hook(adc122s021_quiet_t hook,uint32_t period_us)
+{
+    if (hook && period_us && (NULL == quiet_timer)) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = adc_quiet_callback,
+            .name = "adc_quiet"
+        };
+        if (NULL == quiet_wake)
+            quiet_wake = xSemaphoreCreateBinary();
+        if ((NULL == quiet_wake) || (ESP_OK != esp_timer_create(&timer_args, &quiet_timer))) {
+            ESP_LOGE(p_tag,"No quiet window timer: conversions are not synchronised");
+            return;
+        }
+    }
+
+    xSemaphoreTake(adc_lock,portMAX_DELAY);
+    quiet_period_us = period_us;
+    quiet_hook = (period_us ? hook : NULL);
+    xSemaphoreGive(adc_lock);
+}
+
 //=============================================================================
 // EOF adc122s021.c
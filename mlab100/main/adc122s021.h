@@ -11,6 +11,7 @@
 #include "esp_types.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "sdkconfig.h"
 
 #include "driver/spi_master.h"
 
@@ -20,6 +21,44 @@
 extern "C" {
 #endif // __cplusplus
 
+//-----------------------------------------------------------------------------
+// The fitted part, from the compatible devices sharing the same protocol
+
+#if defined(CONFIG_MLAB_ADC_PART_ADC128S052)
+# define ADC122S021_PART     "ADC128S052"
+# define ADC122S021_CHANNELS (8)
+#elif defined(CONFIG_MLAB_ADC_PART_ADC124S021)
+# define ADC122S021_PART     "ADC124S021"
+# define ADC122S021_CHANNELS (4)
+#else // ADC122S021
+# define ADC122S021_PART     "ADC122S021"
+# define ADC122S021_CHANNELS (2)
+#endif
+
+//-----------------------------------------------------------------------------
+
+// One streamed sample of both channels
+typedef struct {
+    int64_t timestamp;  // esp_timer_get_time() when the conversions were started
+    uint16_t in1;       // 12-bit conversion of IN1
+    uint16_t in2;       // 12-bit conversion of IN2
+} adc122s021_stream_sample_t;
+
+// Streaming counters, reset by adc122s021_stream_start()
+typedef struct {
+    uint32_t samples;   // samples written to the ring
+    uint32_t dropped;   // samples lost because the ring was full
+    uint32_t overruns;  // periods skipped because the previous pair was still running
+    uint32_t errors;    // transactions that could not be queued
+    uint32_t delayed;   // scans held back into a quiet window
+    uint32_t unquiet;   // scans made with no quiet window available
+} adc122s021_stream_stats_t;
+
+// Quiet window callback (see adc122s021_set_quiet_hook()): microseconds until
+// a window of window_us free of interference starts, 0 if now, or more than
+// the hook period if there is none
+typedef uint32_t (*adc122s021_quiet_t)(uint32_t window_us);
+
 //-----------------------------------------------------------------------------
 /**
  * Initialise the SPI bus and enumerate the ADC122S021 device.
@@ -39,6 +78,85 @@ extern spi_device_handle_t app_init_spi(void);
  */
 extern esp_err_t adc122s021_read(spi_device_handle_t spi,uint32_t *p_in1,uint32_t *p_in2);
 
+/**
+ * Read a single ADC122S021 channel as a (left-aligned) 32-bit sample. Unlike
+ * adc122s021_read() nothing is logged, so this is suitable for fast control
+ * loops. Safe to call from several tasks.
+ *
+ * @param spi Handle onto SPI device.
+ * @param channel 0 for IN1, 1 for IN2, up to ADC122S021_CHANNELS - 1.
+ * @param p_result Pointer to field to be filled with the channel value.
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t adc122s021_sample(spi_device_handle_t spi,unsigned int channel,uint32_t *p_result);
+
+/**
+ * Convert a list of channels in a single SPI transaction of (count + 1)
+ * frames. Channels may be repeated and in any order. While streaming only
+ * IN1 and IN2 are available, from the latest streamed sample.
+ *
+ * @param spi Handle onto SPI device.
+ * @param p_channels Channels to convert, each below ADC122S021_CHANNELS.
+ * @param count Number of channels, 1..ADC122S021_CHANNELS.
+ * @param p_results Array to be filled with the 12-bit conversions, in list order.
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t adc122s021_scan(spi_device_handle_t spi,const uint8_t *p_channels,unsigned int count,uint16_t *p_results);
+
+/**
+ * Get the sample period a stream started at the given rate would use, after
+ * any rounding to the quiet hook period (see adc122s021_set_quiet_hook()).
+ *
+ * @param rate_hz Requested sample rate.
+ * @return period in microseconds, or 0 if the rate is not supported.
+ */
+extern uint32_t adc122s021_stream_period(uint32_t rate_hz);
+
+/**
+ * Start streaming both channels at a fixed rate into a ring buffer. While
+ * streaming, adc122s021_read() and adc122s021_sample() return the latest
+ * streamed values instead of starting conversions.
+ *
+ * @param spi Handle onto SPI device.
+ * @param rate_hz Sample rate, up to 10kHz.
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t adc122s021_stream_start(spi_device_handle_t spi,uint32_t rate_hz);
+
+/**
+ * Stop streaming. Samples already in the ring can still be read.
+ */
+extern void adc122s021_stream_stop(void);
+
+/**
+ * Drain up to max samples from the ring, oldest first. Only one task may
+ * read the stream.
+ *
+ * @param p_samples Array to be filled.
+ * @param max Size of the array.
+ * @return number of samples copied.
+ */
+extern size_t adc122s021_stream_read(adc122s021_stream_sample_t *p_samples,size_t max);
+
+/**
+ * Get the streaming counters.
+ */
+extern void adc122s021_stream_get_stats(adc122s021_stream_stats_t *p_stats);
+
+/**
+ * Register a function that times conversions into quiet windows of a
+ * periodic interference source. A single read blocks its task (on a timer,
+ * not spinning) until the window the hook reports. A stream started
+ * afterwards runs at a whole number of hook periods, nearest to the
+ * requested rate, and re-phases its timer onto the window instead of
+ * waiting. The sample timestamps remain exact.
+ *
+ * @param hook Function to call, or NULL for none. Called from the scanning
+ *             task or the esp_timer task and must not block.
+ * @param period_us Period of the interference in microseconds.
+ */
+extern void adc122s021_set_quiet_hook(adc122s021_quiet_t hook,uint32_t period_us);
+
 //-----------------------------------------------------------------------------
 
 #if defined(__cplusplus)
@@ -0,0 +1,184 @@
+// autotune.c
+//=============================================================================
+/*
+ * Relay-feedback PID auto-tuning (Astrom-Hagglund).
+ *
+ * A relay with hysteresis switches the heater between two duty levels as the
+ * block temperature crosses a band around the setpoint. The loop settles
+ * into a limit cycle at its ultimate period Tu, and the describing function
+ * of the relay gives the ultimate gain from the oscillation amplitude a:
+ *
+ *   Ku = 4d / (pi * sqrt(a^2 - e^2))     d = relay half swing, e = hysteresis
+ *
+ * The first period is discarded while the loop settles, then the period and
+ * amplitude are averaged over AUTOTUNE_CYCLES periods. The experiment is
+ * stepped by the caller at its own control rate, so it never blocks.
+ */
+
+//=============================================================================
+
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "autotune.h"
+
+//-----------------------------------------------------------------------------
+
+static const char *p_tag = "autotune"; // for esp-idf logging
+
+#define AUTOTUNE_SETTLE_PERIODS (1) // periods discarded before measuring
+
+// NVS copy of the tuned gains
+#define AUTOTUNE_NVS_NAMESPACE  "pid"
+#define AUTOTUNE_NVS_KEY_GAINS  "gains" // float kp, ki, kd
+
+//-----------------------------------------------------------------------------
+
+void autotune_start(autotune_t *p_at,float setpoint,float out_low,float out_high,float band,uint32_t timeout_s,int64_t now_us)
+{
+    memset(p_at, 0, sizeof(*p_at));
+    p_at->state = AUTOTUNE_RUNNING;
+    p_at->setpoint = setpoint;
+    p_at->out_low = out_low;
+    p_at->out_high = out_high;
+    p_at->band = band;
+    p_at->start_us = now_us;
+    p_at->timeout_us = ((int64_t)timeout_s * 1000000);
+    p_at->relay_high = true;
+    p_at->last_on_us = -1;
+}
+
+//-----------------------------------------------------------------------------
+
+float autotune_update(autotune_t *p_at,float input,int64_t now_us)
+{
+    if (AUTOTUNE_RUNNING != p_at->state)
+        return p_at->out_low;
+
+    if ((now_us - p_at->start_us) > p_at->timeout_us) {
+        ESP_LOGW(p_tag,"No stable oscillation after %u periods",p_at->periods);
+        p_at->state = AUTOTUNE_FAILED;
+        return p_at->out_low;
+    }
+
+    if (input > p_at->peak_max)
+        p_at->peak_max = input;
+    if (input < p_at->peak_min)
+        p_at->peak_min = input;
+
+    if (p_at->relay_high && (input > (p_at->setpoint + p_at->band))) {
+        p_at->relay_high = false;
+    } else if (!p_at->relay_high && (input < (p_at->setpoint - p_at->band))) {
+        // a switch back on closes one period of the limit cycle
+        p_at->relay_high = true;
+        if (p_at->last_on_us >= 0) {
+            p_at->periods++;
+            if (p_at->periods > AUTOTUNE_SETTLE_PERIODS) {
+                p_at->period_sum += ((now_us - p_at->last_on_us) / 1000000.0f);
+                p_at->amplitude_sum += ((p_at->peak_max - p_at->peak_min) / 2);
+                ESP_LOGI(p_tag,"Period %u: %.1f s, %.2f degC peak-to-peak",p_at->periods,((now_us - p_at->last_on_us) / 1000000.0f),(p_at->peak_max - p_at->peak_min));
+            }
+        }
+        p_at->last_on_us = now_us;
+        p_at->peak_max = input;
+        p_at->peak_min = input;
+
+        if (p_at->periods >= (AUTOTUNE_SETTLE_PERIODS + AUTOTUNE_CYCLES)) {
+            float amplitude = (p_at->amplitude_sum / AUTOTUNE_CYCLES);
+            float d = ((p_at->out_high - p_at->out_low) / 2);
+
+            if (amplitude <= p_at->band) {
+                ESP_LOGW(p_tag,"Oscillation %.2f degC within relay band",amplitude);
+                p_at->state = AUTOTUNE_FAILED;
+            } else {
+                p_at->tu = (p_at->period_sum / AUTOTUNE_CYCLES);
+                p_at->ku = ((4 * d) / ((float)M_PI * sqrtf((amplitude * amplitude) - (p_at->band * p_at->band))));
+                ESP_LOGI(p_tag,"Ku %.1f Tu %.1f s",p_at->ku,p_at->tu);
+                p_at->state = AUTOTUNE_DONE;
+            }
+            return p_at->out_low;
+        }
+    }
+
+    return (p_at->relay_high ? p_at->out_high : p_at->out_low);
+}
+
+//-----------------------------------------------------------------------------
+
+unsigned int autotune_progress(const autotune_t *p_at)
+{
+    const unsigned int total = (AUTOTUNE_SETTLE_PERIODS + AUTOTUNE_CYCLES);
+
+    if (AUTOTUNE_DONE == p_at->state)
+        return 100;
+    if (p_at->periods >= total)
+        return 99;
+    return ((p_at->periods * 100) / total);
+}
+
+//-----------------------------------------------------------------------------
+
+bool autotune_gains(const autotune_t *p_at,float *p_kp,float *p_ki,float *p_kd)
+{
+    if ((AUTOTUNE_DONE != p_at->state) || (p_at->tu <= 0))
+        return false;
+
+    *p_kp = (0.6f * p_at->ku);
+    *p_ki = (*p_kp / (p_at->tu / 2));
+    *p_kd = (*p_kp * (p_at->tu / 8));
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t autotune_gains_store(float kp,float ki,float kd)
+{
+    const float gains[3] = { kp, ki, kd };
+    nvs_handle handle;
+    esp_err_t ret;
+
+    ret = nvs_open(AUTOTUNE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ESP_OK == ret) {
+        ret = nvs_set_blob(handle, AUTOTUNE_NVS_KEY_GAINS, gains, sizeof(gains));
+        if (ESP_OK == ret)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGW(p_tag,"Failed to save PID gains (%s)",esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t autotune_gains_load(float *p_kp,float *p_ki,float *p_kd)
+{
+    float gains[3];
+    size_t len = sizeof(gains);
+    nvs_handle handle;
+    esp_err_t ret;
+
+    ret = nvs_open(AUTOTUNE_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (ESP_OK != ret)
+        return ret;
+
+    ret = nvs_get_blob(handle, AUTOTUNE_NVS_KEY_GAINS, gains, &len);
+    nvs_close(handle);
+    if (ESP_OK != ret)
+        return ret;
+    if (sizeof(gains) != len)
+        return ESP_ERR_NVS_INVALID_LENGTH;
+
+    *p_kp = gains[0];
+    *p_ki = gains[1];
+    *p_kd = gains[2];
+    return ESP_OK;
+}
+
+//=============================================================================
+// EOF autotune.c
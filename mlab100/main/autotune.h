@@ -0,0 +1,118 @@
+// autotune.h
+//=============================================================================
+
+#if !defined(__autotune_h)
+#define __autotune_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define AUTOTUNE_CYCLES (4) // oscillation periods averaged after settling
+
+// Auto-tune experiment state
+typedef enum {
+    AUTOTUNE_IDLE,          // no experiment run
+    AUTOTUNE_RUNNING,       // relay oscillation in progress
+    AUTOTUNE_DONE,          // gains available
+    AUTOTUNE_FAILED         // timed out without a stable oscillation
+} autotune_state_t;
+
+// Relay-feedback experiment around a setpoint
+typedef struct {
+    autotune_state_t state;
+    float setpoint;
+    float out_low;          // relay output below the setpoint band
+    float out_high;         // relay output above it
+    float band;             // relay hysteresis, degrees either side of setpoint
+    int64_t start_us;       // experiment start
+    int64_t timeout_us;     // experiment abandoned after this long
+    bool relay_high;        // current relay output
+    int64_t last_on_us;     // time of the last switch to out_high
+    float peak_max;         // extremes of the current period
+    float peak_min;
+    unsigned int periods;   // complete periods seen (including settling)
+    float period_sum;       // seconds, over the measured periods
+    float amplitude_sum;    // degrees (half peak-to-peak), over the measured periods
+    float ku;               // ultimate gain, output units per degree
+    float tu;               // ultimate period, seconds
+} autotune_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Start a relay-feedback (Astrom-Hagglund) experiment. The relay drives the
+ * output between out_low and out_high as the input crosses the band around
+ * the setpoint, which makes the loop oscillate at its ultimate period.
+ *
+ * @param p_at Experiment state.
+ * @param setpoint Centre of the relay band.
+ * @param out_low Output while above the band.
+ * @param out_high Output while below the band.
+ * @param band Relay hysteresis either side of the setpoint (above the probe noise).
+ * @param timeout_s Experiment abandoned after this many seconds.
+ * @param now_us Current esp_timer_get_time().
+ */
+extern void autotune_start(autotune_t *p_at, float setpoint, float out_low, float out_high, float band, uint32_t timeout_s, int64_t now_us);
+
+/**
+ * Feed the experiment a measurement.
+ *
+ * @param p_at Experiment state.
+ * @param input Current measurement.
+ * @param now_us Time of the measurement (esp_timer_get_time()).
+ * @return relay output to apply, or out_low once the experiment has ended.
+ */
+extern float autotune_update(autotune_t *p_at, float input, int64_t now_us);
+
+/**
+ * Get the experiment progress.
+ *
+ * @return percentage of the oscillation periods completed.
+ */
+extern unsigned int autotune_progress(const autotune_t *p_at);
+
+/**
+ * Derive PID gains from a completed experiment with the Ziegler-Nichols
+ * rules (kp = 0.6 Ku, Ti = Tu / 2, Td = Tu / 8).
+ *
+ * @return false if the experiment has not completed.
+ */
+extern bool autotune_gains(const autotune_t *p_at, float *p_kp, float *p_ki, float *p_kd);
+
+/**
+ * Save PID gains to NVS so that they survive a reboot.
+ *
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t autotune_gains_store(float kp, float ki, float kd);
+
+/**
+ * Load the PID gains saved by autotune_gains_store().
+ *
+ * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if none have been saved.
+ */
+extern esp_err_t autotune_gains_load(float *p_kp, float *p_ki, float *p_kd);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__autotune_h
+
+//=============================================================================
+// EOF autotune.h
@@ -0,0 +1,230 @@
+// cascade.c
+//=============================================================================
+/*
+ * Fast inner loop of the cascade heater controller.
+ *
+ * The 1-Wire probes take hundreds of milliseconds per conversion, so the
+ * main control loop only runs at 1Hz. In cascade mode that loop becomes the
+ * outer loop and only adjusts the setpoint of this inner loop, which samples
+ * an analog temperature sensor through the ADC122S021 and writes the heater
+ * duty at CASCADE_PERIOD_US. Disturbances at the heater are then corrected
+ * within a few inner periods rather than after the next probe conversion.
+ *
+ * The periodic esp_timer only notifies the task, so the SPI transfer and the
+ * LEDC update happen at task level. The timer only runs between
+ * cascade_start() and cascade_stop(), so an idle loop costs nothing and
+ * leaves the ADC alone. A notification count above one when the
+ * task wakes means an iteration ran late; those periods are counted as
+ * overruns and skipped rather than run back to back.
+ */
+
+//=============================================================================
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "adc122s021.h"
+#include "heater.h"
+#include "pid.h"
+#include "cascade.h"
+
+//-----------------------------------------------------------------------------
+
+static const char *p_tag = "cascade"; // for esp-idf logging
+
+#define CASCADE_TASK_STACK     (2048)
+#define CASCADE_TASK_PRIORITY  (10) // above the probe acquisition tasks
+
+#define CASCADE_FULL_SCALE     (4294967296.0f) // left-aligned 32-bit samples
+
+//-----------------------------------------------------------------------------
+
+static spi_device_handle_t cascade_spi;
+static unsigned int cascade_channel;
+static float cascade_scale;
+static float cascade_offset;
+
+static TaskHandle_t cascade_task = NULL;
+static esp_timer_handle_t cascade_timer = NULL;
+
+// controller and status are shared between the task and the API
+static SemaphoreHandle_t cascade_lock = NULL;
+static pid_controller_t cascade_pid;
+static cascade_status_t cascade_status;
+static bool cascade_seed;   // the controller is reset from the next measurement
+
+//-----------------------------------------------------------------------------
+
+static void cascade_timer_callback(void *p_arg)
+{
+    xTaskNotifyGive(cascade_task);
+}
+
+//-----------------------------------------------------------------------------
+
+static void cascade_worker(void *p_arg)
+{
+    const float dt = (CASCADE_PERIOD_US / 1000000.0f);
+
+    for (;;) {
+        uint32_t periods = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t sample;
+        esp_err_t ret;
+
+        // a tick left over from before cascade_stop()
+        if (!cascade_status.running)
+            continue;
+
+        // the ADC is read outside the lock: the SPI device has its own
+        ret = adc122s021_sample(cascade_spi, cascade_channel, &sample);
+
+        xSemaphoreTake(cascade_lock, portMAX_DELAY);
+        if (cascade_status.running) {
+            cascade_status.samples++;
+            if (periods > 1)
+                cascade_status.overruns += (periods - 1);
+
+            if (ESP_OK == ret) {
+                int duty;
+
+                cascade_status.measurement = (cascade_offset + (cascade_scale * (sample / CASCADE_FULL_SCALE)));
+                if (cascade_seed) {
+                    // bumpless start from the duty applied when started
+                    pid_reset(&cascade_pid, cascade_status.setpoint, cascade_status.measurement, cascade_status.duty);
+                    cascade_seed = false;
+                }
+                duty = (int)pid_update(&cascade_pid, cascade_status.setpoint, cascade_status.measurement, (periods * dt));
+                if (duty != cascade_status.duty) {
+                    heater_set(duty);
+                    cascade_status.duty = duty;
+                }
+            } else {
+                cascade_status.errors++;
+            }
+        }
+        xSemaphoreGive(cascade_lock);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t cascade_init(spi_device_handle_t spi,unsigned int channel,float scale,float offset)
+{
+    esp_err_t ret;
+
+    if (cascade_task)
+        return ESP_OK; // already initialised
+
+    cascade_spi = spi;
+    cascade_channel = channel;
+    cascade_scale = scale;
+    cascade_offset = offset;
+    pid_init(&cascade_pid, 0, 0, 0, 0, LEDC_MAX_DUTY);
+
+    cascade_lock = xSemaphoreCreateMutex();
+    if (NULL == cascade_lock) {
+        ESP_LOGE(p_tag,"Failed to create lock");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (pdPASS != xTaskCreate(cascade_worker, "cascade", CASCADE_TASK_STACK, NULL, CASCADE_TASK_PRIORITY, &cascade_task)) {
+        ESP_LOGE(p_tag,"Failed to create inner loop task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = cascade_timer_callback,
+        .name = "cascade"
+    };
+    ret = esp_timer_create(&timer_args, &cascade_timer);
+    if (ESP_OK != ret) {
+        ESP_LOGE(p_tag,"Failed to create inner loop timer (%s)",esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+void cascade_set_gains(float kp,float ki,float kd)
+{
+    if (NULL == cascade_lock)
+        return;
+
+    xSemaphoreTake(cascade_lock, portMAX_DELAY);
+    pid_set_gains(&cascade_pid, kp, ki, kd);
+    xSemaphoreGive(cascade_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+void cascade_start(float setpoint,int duty)
+{
+    if ((NULL == cascade_lock) || (NULL == cascade_timer))
+        return;
+
+    xSemaphoreTake(cascade_lock, portMAX_DELAY);
+    if (!cascade_status.running) {
+        esp_err_t ret = esp_timer_start_periodic(cascade_timer, CASCADE_PERIOD_US);
+
+        if (ESP_OK == ret) {
+            cascade_status.setpoint = setpoint;
+            cascade_status.duty = duty;
+            // the last measurement may be stale, so seed from the next one
+            cascade_seed = true;
+            cascade_status.running = true;
+        } else {
+            ESP_LOGE(p_tag,"Failed to start inner loop timer (%s)",esp_err_to_name(ret));
+        }
+    }
+    xSemaphoreGive(cascade_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+void cascade_stop(void)
+{
+    if (NULL == cascade_lock)
+        return;
+
+    xSemaphoreTake(cascade_lock, portMAX_DELAY);
+    if (cascade_status.running) {
+        (void)esp_timer_stop(cascade_timer);
+        cascade_status.running = false;
+    }
+    xSemaphoreGive(cascade_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+void cascade_set_setpoint(float setpoint)
+{
+    if (NULL == cascade_lock)
+        return;
+
+    xSemaphoreTake(cascade_lock, portMAX_DELAY);
+    cascade_status.setpoint = setpoint;
+    xSemaphoreGive(cascade_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+void cascade_get_status(cascade_status_t *p_status)
+{
+    if (NULL == cascade_lock) {
+        memset(p_status, 0, sizeof(*p_status));
+        return;
+    }
+
+    xSemaphoreTake(cascade_lock, portMAX_DELAY);
+    *p_status = cascade_status;
+    xSemaphoreGive(cascade_lock);
+}
+
+//=============================================================================
+// EOF cascade.c
@@ -0,0 +1,97 @@
+// cascade.h
+//=============================================================================
+
+#if !defined(__cascade_h)
+#define __cascade_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "driver/spi_master.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define CASCADE_PERIOD_US (10 * 1000) // inner loop period (100Hz)
+
+// Inner loop status snapshot
+typedef struct {
+    bool running;           // inner loop owns the heater
+    float measurement;      // latest analog sensor reading in degrees Celsius
+    float setpoint;         // inner setpoint in degrees Celsius
+    int duty;               // heater duty last applied
+    uint32_t samples;       // inner loop iterations
+    uint32_t errors;        // failed ADC reads (heater held at the last duty)
+    uint32_t overruns;      // periods missed because an iteration ran late
+} cascade_status_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise the fast inner loop. The loop runs in its own task, woken by a
+ * periodic esp_timer every CASCADE_PERIOD_US while started, and regulates
+ * the heater duty from an ADC122S021 channel scaled to degrees Celsius:
+ *
+ *   degC = offset + scale * (sample / full scale)
+ *
+ * @param spi Handle onto the ADC122S021 device.
+ * @param channel ADC channel of the analog sensor (0 IN1, 1 IN2).
+ * @param scale Degrees Celsius for a full-scale reading.
+ * @param offset Degrees Celsius for a zero reading.
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t cascade_init(spi_device_handle_t spi, unsigned int channel, float scale, float offset);
+
+/**
+ * Set the inner loop gains, in heater duty counts per degree.
+ */
+extern void cascade_set_gains(float kp, float ki, float kd);
+
+/**
+ * Hand the heater to the inner loop. The controller starts bumplessly from
+ * the given duty. Does nothing if already running.
+ *
+ * @param setpoint Initial inner setpoint in degrees Celsius.
+ * @param duty Heater duty currently applied.
+ */
+extern void cascade_start(float setpoint, int duty);
+
+/**
+ * Stop the inner loop. The heater is left at its last duty for the caller to
+ * take over; any iteration in progress completes first.
+ */
+extern void cascade_stop(void);
+
+/**
+ * Set the inner setpoint. This is the outer loop output.
+ *
+ * @param setpoint Inner setpoint in degrees Celsius.
+ */
+extern void cascade_set_setpoint(float setpoint);
+
+/**
+ * Get a snapshot of the inner loop.
+ *
+ * @param p_status Filled with the inner loop status.
+ */
+extern void cascade_get_status(cascade_status_t *p_status);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__cascade_h
+
+//=============================================================================
+// EOF cascade.h
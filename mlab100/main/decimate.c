@@ -0,0 +1,126 @@
+// decimate.c
+//=============================================================================
+/*
+ * Oversampling decimator for ADC streams: an N-stage CIC (cascaded
+ * integrator-comb) filter decimating by R = 2^n, optionally followed by a
+ * short FIR at the output rate, e.g. to flatten the CIC passband droop.
+ *
+ * Everything is integer. The integrators and combs run in modulo 2^32
+ * arithmetic: the integrators wrap, but since the true output is bounded by
+ * the CIC gain R^N times the input range the comb differences are exact, as
+ * long as 12 + N * n stays below 32 bits. The output is the average in ADC
+ * counts with DECIMATE_FRAC_BITS of fraction; the extra resolution is real
+ * when the input noise dithers the LSB.
+ */
+
+//=============================================================================
+
+#include <string.h>
+
+#include "decimate.h"
+
+//-----------------------------------------------------------------------------
+
+#define DECIMATE_INPUT_BITS (12)
+#define DECIMATE_GAIN_MAX   (31 - DECIMATE_INPUT_BITS) // bits of CIC gain
+
+//-----------------------------------------------------------------------------
+
+esp_err_t decimate_init(decimate_t *p_dec,unsigned int order,unsigned int log2_ratio,const int16_t *p_fir,unsigned int fir_taps)
+{
+    if ((order < 1) || (order > DECIMATE_ORDER_MAX))
+        return ESP_ERR_INVALID_ARG;
+    if ((order * log2_ratio) > DECIMATE_GAIN_MAX)
+        return ESP_ERR_INVALID_ARG;
+    if (p_fir && ((fir_taps < 1) || (fir_taps > DECIMATE_FIR_MAX)))
+        return ESP_ERR_INVALID_ARG;
+
+    memset(p_dec,'\0',sizeof(*p_dec));
+    p_dec->order = order;
+    p_dec->log2_ratio = log2_ratio;
+    p_dec->shift = (int)(order * log2_ratio) - DECIMATE_FRAC_BITS;
+    p_dec->p_fir = p_fir;
+    p_dec->fir_taps = (p_fir ? fir_taps : 0);
+
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+void decimate_reset(decimate_t *p_dec)
+{
+    p_dec->phase = 0;
+    p_dec->fir_pos = 0;
+    memset(p_dec->integrator,'\0',sizeof(p_dec->integrator));
+    memset(p_dec->comb,'\0',sizeof(p_dec->comb));
+    memset(p_dec->fir_history,'\0',sizeof(p_dec->fir_history));
+}
+
+//-----------------------------------------------------------------------------
+
+static int32_t decimate_fir(decimate_t *p_dec,int32_t value)
+{
+    unsigned int pos = p_dec->fir_pos;
+    int64_t acc = 0;
+    unsigned int i;
+
+    p_dec->fir_history[pos] = value;
+    p_dec->fir_pos = ((pos + 1) % p_dec->fir_taps);
+
+    // tap 0 against the newest sample
+    for (i = 0; i < p_dec->fir_taps; i++) {
+        acc += ((int64_t)p_dec->p_fir[i] * p_dec->fir_history[pos]);
+        pos = ((0 == pos) ? (p_dec->fir_taps - 1) : (pos - 1));
+    }
+
+    return (int32_t)((acc + (1 << 14)) >> 15);
+}
+
+//-----------------------------------------------------------------------------
+
+size_t decimate_process(decimate_t *p_dec,const uint16_t *p_in,size_t count,int32_t *p_out)
+{
+    const unsigned int ratio = (1U << p_dec->log2_ratio);
+    const unsigned int order = p_dec->order;
+    uint32_t *p_int = p_dec->integrator;
+    size_t produced = 0;
+    size_t n;
+    unsigned int s;
+
+    for (n = 0; n < count; n++) {
+        uint32_t acc = p_in[n];
+
+        // integrators at the input rate
+        for (s = 0; s < order; s++) {
+            p_int[s] += acc;
+            acc = p_int[s];
+        }
+
+        if (++p_dec->phase < ratio)
+            continue;
+        p_dec->phase = 0;
+
+        // combs at the output rate
+        for (s = 0; s < order; s++) {
+            uint32_t delayed = p_dec->comb[s];
+            p_dec->comb[s] = acc;
+            acc -= delayed;
+        }
+
+        int32_t value;
+        if (p_dec->shift >= 0)
+            value = (int32_t)((acc + ((1U << p_dec->shift) >> 1)) >> p_dec->shift);
+        else
+            value = (int32_t)(acc << -p_dec->shift);
+
+        if (p_dec->fir_taps)
+            value = decimate_fir(p_dec,value);
+
+        p_out[produced++] = value;
+    }
+
+    return produced;
+}
+
+//=============================================================================
+// EOF decimate.c
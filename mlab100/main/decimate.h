@@ -0,0 +1,83 @@
+// decimate.h
+//=============================================================================
+
+#if !defined(__decimate_h)
+#define __decimate_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "esp_err.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define DECIMATE_ORDER_MAX (4)  // CIC stages
+#define DECIMATE_FIR_MAX   (16) // FIR taps
+#define DECIMATE_FRAC_BITS (8)  // fraction bits in the output samples
+
+// Decimator state. Input samples are 12-bit ADC counts; output samples are
+// the filtered average in counts with DECIMATE_FRAC_BITS of fraction.
+typedef struct {
+    unsigned int order;                     // CIC stages, 1 is a boxcar average
+    unsigned int log2_ratio;                // decimation ratio is 2^log2_ratio
+    int shift;                              // CIC gain to output scaling
+    const int16_t *p_fir;                   // Q15 taps at the output rate, or NULL
+    unsigned int fir_taps;
+    unsigned int phase;                     // inputs into the current output
+    uint32_t integrator[DECIMATE_ORDER_MAX];
+    uint32_t comb[DECIMATE_ORDER_MAX];      // previous integrator output per comb
+    int32_t fir_history[DECIMATE_FIR_MAX];
+    unsigned int fir_pos;
+} decimate_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise a decimator. Each output sample has about (log2_ratio / 2) more
+ * bits of resolution than the input, if the input noise dithers the LSB.
+ *
+ * @param p_dec Decimator to initialise.
+ * @param order CIC stages, 1..DECIMATE_ORDER_MAX. 1 is a plain boxcar.
+ * @param log2_ratio Decimation ratio as a power of two; order * log2_ratio must not exceed 19.
+ * @param p_fir Q15 FIR taps (summing to 32768 for unity gain) applied at the output rate, or NULL.
+ * @param fir_taps Number of taps, up to DECIMATE_FIR_MAX. The taps are not copied.
+ * @return ESP_OK on success, or ESP_ERR_INVALID_ARG.
+ */
+extern esp_err_t decimate_init(decimate_t *p_dec,unsigned int order,unsigned int log2_ratio,const int16_t *p_fir,unsigned int fir_taps);
+
+/**
+ * Restart the filter, discarding the history.
+ */
+extern void decimate_reset(decimate_t *p_dec);
+
+/**
+ * Filter a block of input samples.
+ *
+ * @param p_dec Decimator.
+ * @param p_in 12-bit input samples.
+ * @param count Number of input samples.
+ * @param p_out Array to be filled with output samples; needs room for count / 2^log2_ratio + 1.
+ * @return number of output samples written.
+ */
+extern size_t decimate_process(decimate_t *p_dec,const uint16_t *p_in,size_t count,int32_t *p_out);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__decimate_h
+
+//=============================================================================
+// EOF decimate.h
@@ -3,7 +3,11 @@
 /* 
  * DS18B20 Temperature Sensor
  *
- * NOTE: this implementation assumes only one 1-Wire device connected to the bus.
+ * Devices are addressed by ROM code, so any number may share a bus, and each
+ * call names the bus GPIO so several buses can be used concurrently. A
+ * conversion is started on every device of a bus at once (Skip ROM) and the
+ * scratchpads are then read one by one. Per-device state (resolution and read
+ * statistics) is kept for up to DS18B20_MAX_DEVICES devices across all buses.
  *
  * https://www.maximintegrated.com/en/app-notes/index.mvp/id/126
  *
@@ -11,165 +15,310 @@
 
 //=============================================================================
 
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
-#include "rom/ets_sys.h"
 
 #include "onewire.h"
+#include "ds18b20.h"
 #include "mlab100.h"
+
 //-----------------------------------------------------------------------------
 
-// GPIO pin for DS18B20 temperature sensor connected to TEMP1W on J3
-//#define DS_GPIO (15)
-// #define DS_GPIO (32)
+#define DS18B20_CONVERT_T          (0x44)
+#define DS18B20_WRITE_SCRATCHPAD    (0x4E)
+#define DS18B20_READ_SCRATCHPAD     (0xBE)
+#define DS18B20_COPY_SCRATCHPAD     (0x48)
 
-//=============================================================================
+// Scratchpad layout
+#define DS18B20_SP_TEMP_LSB         (0)
+#define DS18B20_SP_TEMP_MSB         (1)
+#define DS18B20_SP_TH               (2)
+#define DS18B20_SP_TL               (3)
+#define DS18B20_SP_CONFIG           (4)
+#define DS18B20_SP_CRC              (8)
+#define DS18B20_SP_SIZE             (9)
+
+// Configuration register R1:R0 select 9..12 bit resolution
+#define DS18B20_CONFIG_RES(_bits)   ((((_bits) - 9) << 5) | 0x1F)
+
+#define DS18B20_COPY_MS             (10) // EEPROM write time
 
-#ifdef NODEF
+// Bounds on re-reading a scratchpad that failed validation
+#define DS18B20_READ_ATTEMPTS       (3)
+#define DS18B20_READ_BUDGET_US      (40 * 1000)
+
+// Round a wait in microseconds up to whole RTOS ticks
+#define US_TO_TICKS(_us)            ((((_us) + 999) / 1000 + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS)
 
 //-----------------------------------------------------------------------------
-// Send one bit to the 1-Wire bus
-
-static void ds18b20_send(char bit){
-  gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
-  gpio_set_level(DS_GPIO,0);
-  ets_delay_us(5);
-  if (bit == 1) 
-    gpio_set_level(DS_GPIO,1);
-  ets_delay_us(80);
-  gpio_set_level(DS_GPIO,1);
+/* Per-device state, looked up by ROM address. Devices we have never
+   configured are at their power-on default of 12-bit resolution. */
+
+#define DS18B20_MAX_DEVICES         (16)
+
+typedef struct {
+    onewire_addr_t addr;
+    uint8_t resolution;
+    ds18b20_stats_t stats;
+} ds18b20_device_t;
+
+// devices on different buses are accessed concurrently
+static portMUX_TYPE ds18b20_mux = portMUX_INITIALIZER_UNLOCKED;
+static ds18b20_device_t ds18b20_devices[DS18B20_MAX_DEVICES];
+static unsigned int ds18b20_device_count;
+
+static ds18b20_device_t *ds18b20_device(onewire_addr_t device_addr, bool create) {
+    ds18b20_device_t *p_dev = NULL;
+    unsigned int i;
+
+    portENTER_CRITICAL(&ds18b20_mux);
+    for (i = 0; i < ds18b20_device_count; i++) {
+        if (ds18b20_devices[i].addr == device_addr) {
+            p_dev = &ds18b20_devices[i];
+            break;
+        }
+    }
+    if ((NULL == p_dev) && create && (ds18b20_device_count < DS18B20_MAX_DEVICES)) {
+        p_dev = &ds18b20_devices[ds18b20_device_count++];
+        memset(p_dev, 0, sizeof(ds18b20_device_t));
+        p_dev->addr = device_addr;
+        p_dev->resolution = DS18B20_RESOLUTION_12_BIT;
+    }
+    portEXIT_CRITICAL(&ds18b20_mux);
+
+    return p_dev;
 }
 
 //-----------------------------------------------------------------------------
-// Read one bit from the 1-Wire bus
-
-static unsigned char ds18b20_read(void){
-  unsigned char presence = 0;
-
-  gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
-  gpio_set_level(DS_GPIO, 0);
-  ets_delay_us(2);
-  gpio_set_level(DS_GPIO, 1);
-  ets_delay_us(15);
-  gpio_set_direction(DS_GPIO, GPIO_MODE_INPUT);
-  if (gpio_get_level(DS_GPIO) == 1) 
-    presence = 1; 
-  else 
-    presence = 0;
-  return(presence);
+// Read the raw scratchpad of the addressed device
+
+static bool ds18b20_read_scratchpad(gpio_num_t pin, onewire_addr_t device_addr, uint8_t *p_buf, size_t count) {
+    if (!onewire_reset(pin))
+        return false;
+
+    onewire_select(pin, device_addr);
+    onewire_write(pin, DS18B20_READ_SCRATCHPAD);
+    return onewire_read_bytes(pin, p_buf, count);
+}
+
+//-----------------------------------------------------------------------------
+// Convert the scratchpad temperature register, masking the bits that are
+// undefined at lower resolutions
+
+static float ds18b20_decode(const uint8_t *p_buf, unsigned int resolution) {
+    int16_t raw = (int16_t)((p_buf[DS18B20_SP_TEMP_MSB] << 8) | p_buf[DS18B20_SP_TEMP_LSB]);
+
+    raw &= ~((1 << (DS18B20_RESOLUTION_12_BIT - resolution)) - 1);
+    return (float)raw / 16;
 }
 
 //-----------------------------------------------------------------------------
-// Send one byte to the 1-Wire bus
-
-static void ds18b20_send_byte(char data){
-  unsigned char i;
-  unsigned char x;
-
-  for (i = 0; i < 8; i++) {
-    x = data >> i;
-    x &= 0x01;
-    ds18b20_send(x);
-  }
-  ets_delay_us(100);
+// Read and validate the full scratchpad. An all-zero scratchpad (bus held low)
+// has a valid CRC, so the configuration register's fixed bits are checked too.
+
+static esp_err_t ds18b20_read_validated(gpio_num_t pin, onewire_addr_t device_addr, uint8_t *p_buf) {
+    if (!ds18b20_read_scratchpad(pin, device_addr, p_buf, DS18B20_SP_SIZE))
+        return ESP_ERR_NOT_FOUND;
+
+    if ((onewire_crc8(p_buf, DS18B20_SP_CRC) != p_buf[DS18B20_SP_CRC]) || (0x1F != (p_buf[DS18B20_SP_CONFIG] & 0x1F)))
+        return ESP_ERR_INVALID_CRC;
+
+    return ESP_OK;
 }
 
 //-----------------------------------------------------------------------------
-// Read one byte from the 1-Wire bus
-
-static unsigned char ds18b20_read_byte(void){
-  unsigned char i;
-  unsigned char data = 0;
-
-  for (i = 0; i < 8; i++) {
-    if (ds18b20_read()) 
-      data |= 0x01 << i;
-    ets_delay_us(15);
-  }
-  return(data);
+// Read the temperature held in the scratchpad of the addressed device,
+// retrying a bounded number of times within a time budget
+
+esp_err_t ds18b20_read_temp(gpio_num_t pin, onewire_addr_t device_addr, float *p_temp) {
+    ds18b20_device_t *p_dev = ds18b20_device(device_addr, true);
+    int64_t start = esp_timer_get_time();
+    uint8_t buf[DS18B20_SP_SIZE];
+    ds18b20_stats_t counts = {0};
+    esp_err_t ret = ESP_FAIL;
+    unsigned int attempt;
+
+    for (attempt = 0; attempt < DS18B20_READ_ATTEMPTS; attempt++) {
+        if (attempt) {
+            if ((esp_timer_get_time() - start) > DS18B20_READ_BUDGET_US)
+                break;
+            counts.retries++;
+        }
+
+        ret = ds18b20_read_validated(pin, device_addr, buf);
+        if (ESP_OK == ret)
+            break;
+
+        if (ESP_ERR_NOT_FOUND == ret)
+            counts.presence_errors++;
+        else
+            counts.crc_errors++;
+    }
+
+    // other buses update their devices' statistics concurrently
+    if (p_dev) {
+        portENTER_CRITICAL(&ds18b20_mux);
+        p_dev->stats.reads++;
+        if (ESP_OK != ret)
+            p_dev->stats.failures++;
+        p_dev->stats.retries += counts.retries;
+        p_dev->stats.crc_errors += counts.crc_errors;
+        p_dev->stats.presence_errors += counts.presence_errors;
+        portEXIT_CRITICAL(&ds18b20_mux);
+    }
+
+    if (ESP_OK == ret) {
+        *p_temp = ds18b20_decode(buf, (DS18B20_RESOLUTION_9_BIT + ((buf[DS18B20_SP_CONFIG] >> 5) & 0x3)));
+    }
+    return ret;
 }
 
 //-----------------------------------------------------------------------------
-// Send a reset pulse to the 1-Wire bus
-
-static unsigned char ds18b20_RST_PULSE(void){
-  unsigned char presence;
-
-  gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
-  gpio_set_level(DS_GPIO, 0);
-  ets_delay_us(500);
-  gpio_set_level(DS_GPIO, 1);
-  gpio_set_direction(DS_GPIO, GPIO_MODE_INPUT);
-  ets_delay_us(30);
-  if (gpio_get_level(DS_GPIO) == 0) 
-    presence = 1; 
-  else 
-    presence = 0;
-  ets_delay_us(470);
-  if (gpio_get_level(DS_GPIO) == 1) 
-    presence = 1; 
-  else 
-    presence = 0;
-  return presence;
+// Start a temperature conversion on every device on the bus at once
+
+bool ds18b20_convert_all(gpio_num_t pin) {
+    if (!onewire_reset(pin))
+        return false;
+
+    onewire_skip_rom(pin);
+    return onewire_write(pin, DS18B20_CONVERT_T);
 }
 
 //-----------------------------------------------------------------------------
-// Return a temperature reading from the DS18B20
-
-float ds18b20_get_temp(void) {
-  unsigned char check;
-  char temp1 = 0, temp2 = 0;
-
-  check = ds18b20_RST_PULSE();
-  if (check == 1) {
-    ds18b20_send_byte(0xCC);  // skip ROM
-    ds18b20_send_byte(0x44);  // Convert T (move value into Scratchpad)
-    vTaskDelay(750 / portTICK_RATE_MS);
-    check = ds18b20_RST_PULSE();
-    ds18b20_send_byte(0xCC);  // skip ROM
-    ds18b20_send_byte(0xBE);  // Read Scratchpad
-    temp1 = ds18b20_read_byte();
-    temp2 = ds18b20_read_byte();
-    check = ds18b20_RST_PULSE();
-    //    printf("\ttemp1: 0x%X temp2: 0x%X ds18b20_RST_PULSE: %d\n", check, temp1, temp2); // DEBUG
-    float temp = 0;
-    temp = (float)(temp1 + (temp2 * 256)) / 16;
-    return temp;
-  }
-  else
-    return 0;
-  }
-#endif
-
-float ds18b20_get_temp(onewire_addr_t device_addr) {
-  char temp1 = 0, temp2 = 0;
-  bool reply;
-
-  reply = onewire_reset(ONEWIRE_PIN);
-  if (reply) {
-
-    onewire_select(ONEWIRE_PIN, device_addr);
-    onewire_write(ONEWIRE_PIN, 0x44); // Convert T (move value into Scratchpad)
-    vTaskDelay(150 / portTICK_RATE_MS);   // was 750ms
-    onewire_reset(ONEWIRE_PIN);
-
-    onewire_select(ONEWIRE_PIN, device_addr);
-    onewire_write(ONEWIRE_PIN, 0xBE); // Read Scratchpad
-
-    temp1 = onewire_read(ONEWIRE_PIN);
-    temp2 = onewire_read(ONEWIRE_PIN);
-//    reply = onewire_reset(ONEWIRE_PIN);
-
-    // printf("\ttemp1: 0x%X temp2: 0x%X ds18b20_RST_PULSE: %d\n", temp1, temp2, reply); // DEBUG
-    float temp = 0;
-    temp = (float)(temp1 + (temp2 * 256)) / 16;
-    return temp;
-  }
-  else
-    return 0;
+// Conversion time from the datasheet: 93.75ms at 9-bit, doubling per bit
+
+uint32_t ds18b20_conversion_us(unsigned int resolution) {
+    if ((resolution < DS18B20_RESOLUTION_9_BIT) || (resolution > DS18B20_RESOLUTION_12_BIT))
+        resolution = DS18B20_RESOLUTION_12_BIT;
+
+    return (93750 << (resolution - DS18B20_RESOLUTION_9_BIT));
 }
+
+uint32_t ds18b20_conversion_max_us(const onewire_addr_t *p_addrs, unsigned int count) {
+    unsigned int resolution = DS18B20_RESOLUTION_9_BIT;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (ds18b20_get_resolution(p_addrs[i]) > resolution)
+            resolution = ds18b20_get_resolution(p_addrs[i]);
+    }
+    return ds18b20_conversion_us(resolution);
+}
+
+//-----------------------------------------------------------------------------
+
+unsigned int ds18b20_get_resolution(onewire_addr_t device_addr) {
+    ds18b20_device_t *p_dev = ds18b20_device(device_addr, false);
+
+    return (p_dev ? p_dev->resolution : DS18B20_RESOLUTION_12_BIT);
+}
+
+//-----------------------------------------------------------------------------
+
+bool ds18b20_get_stats(onewire_addr_t device_addr, ds18b20_stats_t *p_stats) {
+    ds18b20_device_t *p_dev = ds18b20_device(device_addr, false);
+
+    if (NULL == p_dev)
+        return false;
+
+    portENTER_CRITICAL(&ds18b20_mux);
+    *p_stats = p_dev->stats;
+    portEXIT_CRITICAL(&ds18b20_mux);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Write TH, TL and the configuration register, optionally copying them to
+// EEPROM
+
+static bool ds18b20_write_scratchpad(gpio_num_t pin, onewire_addr_t device_addr, uint8_t th, uint8_t tl, uint8_t config, bool persist) {
+    if (!onewire_reset(pin))
+        return false;
+    onewire_select(pin, device_addr);
+    onewire_write(pin, DS18B20_WRITE_SCRATCHPAD);
+    onewire_write(pin, th);
+    onewire_write(pin, tl);
+    onewire_write(pin, config);
+
+    if (persist) {
+        // copy to EEPROM so the setting survives a power cycle
+        if (!onewire_reset(pin))
+            return false;
+        onewire_select(pin, device_addr);
+        onewire_write(pin, DS18B20_COPY_SCRATCHPAD);
+        onewire_power(pin);
+        vTaskDelay(US_TO_TICKS(DS18B20_COPY_MS * 1000));
+        onewire_depower(pin);
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Write the configuration register, preserving the alarm thresholds
+
+bool ds18b20_set_resolution(gpio_num_t pin, onewire_addr_t device_addr, unsigned int resolution, bool persist) {
+    uint8_t buf[DS18B20_SP_SIZE];
+    ds18b20_device_t *p_dev;
+
+    if ((resolution < DS18B20_RESOLUTION_9_BIT) || (resolution > DS18B20_RESOLUTION_12_BIT))
+        return false;
+
+    p_dev = ds18b20_device(device_addr, true);
+    if (NULL == p_dev)
+        return false;
+
+    if (ESP_OK != ds18b20_read_validated(pin, device_addr, buf))
+        return false;
+
+    if (!ds18b20_write_scratchpad(pin, device_addr, buf[DS18B20_SP_TH], buf[DS18B20_SP_TL], DS18B20_CONFIG_RES(resolution), persist))
+        return false;
+    p_dev->resolution = resolution;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Write the alarm thresholds, preserving the configuration register
+
+bool ds18b20_set_alarm(gpio_num_t pin, onewire_addr_t device_addr, int8_t high, int8_t low, bool persist) {
+    uint8_t buf[DS18B20_SP_SIZE];
+
+    if (low > high)
+        return false;
+
+    if (ESP_OK != ds18b20_read_validated(pin, device_addr, buf))
+        return false;
+
+    return ds18b20_write_scratchpad(pin, device_addr, (uint8_t)high, (uint8_t)low, buf[DS18B20_SP_CONFIG], persist);
+}
+
+//-----------------------------------------------------------------------------
+// Sweep the bus with Alarm Search for devices whose last conversion was out
+// of band
+
+unsigned int ds18b20_alarm_search(gpio_num_t pin, onewire_addr_t *p_addrs, unsigned int max) {
+    onewire_search_t search;
+    unsigned int count = 0;
+
+    onewire_search_start(&search);
+    while (count < max) {
+        onewire_addr_t addr = onewire_search_next_alarm(&search, pin);
+        if (ONEWIRE_NONE == addr)
+            break;
+        p_addrs[count++] = addr;
+        if (search.last_device_found)
+            break;
+    }
+
+    return count;
+}
+
 //-----------------------------------------------------------------------------
 // Initialize the DS18B20
 
@@ -1,17 +1,40 @@
 // ds18b20.h
 //=============================================================================
 
-#if !defined(_ds18b20_)
+#if !defined(__ds18b20_)
 #define __ds18b20_ (1)
 
+#include "esp_err.h"
 #include "onewire.h"
 
 /*
- * NOTE: this implementation assumes only one 1-Wire device connected to the bus.
+ * Every bus operation takes the GPIO of the 1-Wire bus the device is on, so
+ * devices may be spread across several independent buses.
  *
  * https://www.maximintegrated.com/en/app-notes/index.mvp/id/126
  */
 
+//-----------------------------------------------------------------------------
+
+// Conversion resolution in bits (12-bit is the power-on default)
+#define DS18B20_RESOLUTION_9_BIT   (9)
+#define DS18B20_RESOLUTION_10_BIT  (10)
+#define DS18B20_RESOLUTION_11_BIT  (11)
+#define DS18B20_RESOLUTION_12_BIT  (12)
+
+// Measurement range in degrees Celsius, also the widest alarm thresholds
+#define DS18B20_TEMP_MIN  (-55)
+#define DS18B20_TEMP_MAX  (125)
+
+// Per-device read statistics
+typedef struct {
+    uint32_t reads;             // validated reads requested
+    uint32_t failures;          // reads that failed after all retries
+    uint32_t retries;           // additional attempts made
+    uint32_t crc_errors;        // attempts with a corrupt scratchpad
+    uint32_t presence_errors;   // attempts with no presence pulse
+} ds18b20_stats_t;
+
 //-----------------------------------------------------------------------------
 /**
  * Initialise the 1-Wire bus.
@@ -20,11 +43,108 @@
 extern void ds18b20_init(void);
 
 /**
- * Get a temperature reading from the DS18D20. 
+ * Read the result of a previous conversion from the DS18B20 scratchpad.
+ * No conversion is started, so the caller must have waited at least
+ * ds18b20_conversion_us() since the conversion was issued. The full
+ * scratchpad is read and checked against its CRC; failed reads are retried a
+ * bounded number of times and counted against the device (see
+ * ds18b20_get_stats()).
+ *
+ * @param pin GPIO of the 1-Wire bus the device is on.
+ * @param device_addr ROM address of the device to read.
+ * @param p_temp Filled with the temperature in degrees Celsius on success.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the device did not answer,
+ *         or ESP_ERR_INVALID_CRC if the scratchpad was corrupt.
+ */
+extern esp_err_t ds18b20_read_temp(gpio_num_t pin, onewire_addr_t device_addr, float *p_temp);
+
+/**
+ * Start a temperature conversion on all devices on the bus (Skip ROM +
+ * Convert T). The results are available in each device scratchpad once the
+ * conversion time has elapsed.
+ *
+ * @param pin GPIO of the 1-Wire bus.
+ * @return true if at least one device answered the reset pulse.
+ */
+extern bool ds18b20_convert_all(gpio_num_t pin);
+
+/**
+ * Get the conversion time for a resolution, from the datasheet maximum
+ * (93.75/187.5/375/750 ms for 9/10/11/12 bits).
+ *
+ * @param resolution Conversion resolution in bits.
+ * @return conversion time in microseconds.
+ */
+extern uint32_t ds18b20_conversion_us(unsigned int resolution);
+
+/**
+ * Get the conversion time for a bus-wide conversion, which is that of the
+ * highest resolution device.
+ *
+ * @param p_addrs Vector of count device ROM addresses.
+ * @param count Number of devices.
+ * @return conversion time in microseconds.
+ */
+extern uint32_t ds18b20_conversion_max_us(const onewire_addr_t *p_addrs, unsigned int count);
+
+/**
+ * Get the resolution last configured for a device.
+ *
+ * @param device_addr ROM address of the device.
+ * @return resolution in bits.
+ */
+extern unsigned int ds18b20_get_resolution(onewire_addr_t device_addr);
+
+/**
+ * Get the read statistics accumulated for a device.
+ *
+ * @param device_addr ROM address of the device.
+ * @param p_stats Filled with the device statistics.
+ * @return false if the device has never been read.
+ */
+extern bool ds18b20_get_stats(onewire_addr_t device_addr, ds18b20_stats_t *p_stats);
+
+/**
+ * Set the conversion resolution of a device with Write Scratchpad. The alarm
+ * thresholds are preserved. Only persist the setting (Copy Scratchpad to
+ * EEPROM) for configuration changes, not for run-time switching, since the
+ * EEPROM has limited write endurance.
+ *
+ * @param pin GPIO of the 1-Wire bus the device is on.
+ * @param device_addr ROM address of the device.
+ * @param resolution Resolution in bits (9 to 12).
+ * @param persist true to also copy the setting to EEPROM.
+ * @return true on success.
+ */
+extern bool ds18b20_set_resolution(gpio_num_t pin, onewire_addr_t device_addr, unsigned int resolution, bool persist);
+
+/**
+ * Set the alarm thresholds of a device with Write Scratchpad. The
+ * configuration register is preserved. After each conversion the device
+ * flags an alarm if the integer part of the temperature is >= high or
+ * <= low, and only flagged devices answer ds18b20_alarm_search().
+ *
+ * @param pin GPIO of the 1-Wire bus the device is on.
+ * @param device_addr ROM address of the device.
+ * @param high Upper threshold (TH) in degrees Celsius.
+ * @param low Lower threshold (TL) in degrees Celsius.
+ * @param persist true to also copy the thresholds to EEPROM.
+ * @return true on success.
+ */
+extern bool ds18b20_set_alarm(gpio_num_t pin, onewire_addr_t device_addr, int8_t high, int8_t low, bool persist);
+
+/**
+ * Find the devices on a bus whose last conversion raised an alarm, using a
+ * single Alarm Search sweep rather than reading every scratchpad. The alarm
+ * flags are only updated by a conversion, so this reflects the most recent
+ * ds18b20_convert_all().
  *
- * @return temperature in degrees Celsius.
+ * @param pin GPIO of the 1-Wire bus.
+ * @param p_addrs Vector of max entries filled with the ROM addresses in alarm.
+ * @param max Maximum number of addresses to return.
+ * @return number of devices in alarm.
  */
-extern float ds18b20_get_temp(onewire_addr_t device_addr);
+extern unsigned int ds18b20_alarm_search(gpio_num_t pin, onewire_addr_t *p_addrs, unsigned int max);
 
 //-----------------------------------------------------------------------------
 
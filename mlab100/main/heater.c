@@ -3,7 +3,30 @@
 /* 
  * Heater Control -- using ESP32 integrated PWM LED Controller
  *
+ * With CONFIG_MLAB_HEATER_DITHER the heater accepts fractional duty: the
+ * fraction is spread over successive PWM periods by a first-order
+ * sigma-delta (error feedback) accumulator stepped from an esp_timer, so the
+ * average duty has CONFIG_MLAB_HEATER_DITHER_BITS more bits of resolution.
+ * The output only ever moves between two adjacent duty counts, so it keeps
+ * the 5 kHz switching edges of the plain PWM. (The SIGMADELTA peripheral is
+ * not used: it has only 8 bits of duty and switches the heater MOSFET at
+ * MHz rates, right next to the 1-Wire and ADC lines.)
  *
+ * Switching is done with heater_request() and fan_request(). The new levels
+ * are committed from the probes quiet hook, at the start of the window in
+ * which no 1-Wire bus has any traffic, and each channel is moved with a
+ * hardware fade: first the channel whose duty is falling, then the one
+ * rising, so the supply never sees both step at once. Both fades complete
+ * well inside the shortest (9-bit) conversion. heater_set() and fan_set()
+ * still apply at once for loops that make small continuous adjustments.
+ *
+ * For the analog front end, heater_quiet_delay() reports when the next
+ * stretch of the PWM period without a switching edge on either channel
+ * starts, from the LEDC timer counter and each channel's hpoint and duty, so
+ * ADC conversions can be placed clear of the edges. heater_blank() takes the
+ * heater pin off the LEDC output (driving it low) without touching the LEDC
+ * state, so fades, dithering and requests carry on and the heater resumes
+ * at its current level when released.
 */
 
 //=============================================================================
@@ -13,17 +36,55 @@
 #include "esp_system.h"
 #include "driver/gpio.h"
 #include "rom/ets_sys.h"
+#include "rom/gpio.h"
+#include "soc/gpio_sig_map.h"
+#include "soc/ledc_struct.h"
 
 #include "driver/ledc.h"
 #include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "heater.h"
 #include "mlab100.h"
+#include "probes.h"
 
-// control the heater using LEDC channel 0
+// control the heater using LEDC channel 0 and the fan using channel 1
 #define LEDC_HS_TIMER          LEDC_TIMER_0
 #define LEDC_HS_MODE           LEDC_HIGH_SPEED_MODE
-#define LEDC_HS_CH0_GPIO       (32)
+#define LEDC_HS_CH0_GPIO       (HEATER_CTRL)
 #define LEDC_HS_CH0_CHANNEL    LEDC_CHANNEL_0
+#define LEDC_HS_CH1_GPIO       (FAN_CTRL)
+#define LEDC_HS_CH1_CHANNEL    LEDC_CHANNEL_1
+
+static const char *p_tag = "heater"; // for esp-idf logging
+
+#define HEATER_FADE_MS         (20) // per channel: both fit inside a 94ms 9-bit conversion
+
+#define HEATER_EDGE_GUARD_US   (5) // ringing after a switching edge
+
+static volatile bool heater_blanked;
+
+/* Requested levels not yet committed, guarded by heater_mux. While a commit
+   is fading the channels further requests wait for the next one. */
+static portMUX_TYPE heater_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool heater_pending;
+static float heater_target;
+static bool fan_pending;
+static int fan_target;
+static volatile bool heater_fading;
+static int heater_rising = -1; // duty to fade up once the falling channel is done, or -1
+static int fan_rising = -1;
+static esp_timer_handle_t heater_fade_timer;
+
+#if defined(CONFIG_MLAB_HEATER_DITHER) && CONFIG_MLAB_HEATER_DITHER
+#define HEATER_DITHER_BITS      (CONFIG_MLAB_HEATER_DITHER_BITS)
+#define HEATER_DITHER_MASK      ((1U << HEATER_DITHER_BITS) - 1)
+#define HEATER_DITHER_PERIOD_US (1000) // every 5 PWM periods
+
+static esp_timer_handle_t heater_dither_timer;
+static volatile uint32_t heater_level; // duty with HEATER_DITHER_BITS of fraction
+static uint32_t heater_dither_acc;     // only touched by the timer callback
+#endif // CONFIG_MLAB_HEATER_DITHER
 
 /*
  * Prepare and set configuration of timers 7232
@@ -31,16 +92,149 @@
  *
  * With PWM frequency at 5 kHz, the maximum duty resolution is 13 bits. 
  * The duty may be set from 0 to 100% with resolution of ~0.012% 
- * (13 ** 2 = 8192 discrete levels of heater intensity).
+ * (13 ** 2 = 8192 discrete levels of heater intensity). The fan shares the
+ * timer, and so the same duty range.
 
  */
 ledc_timer_config_t ledc_timer = {
     .duty_resolution = LEDC_TIMER_13_BIT, // resolution of PWM duty
-    .freq_hz = 5000,                      // frequency of PWM signal
+    .freq_hz = HEATER_PWM_HZ,             // frequency of PWM signal
     .speed_mode = LEDC_HS_MODE,           // high-speed timer mode
     .timer_num = LEDC_HS_TIMER            // high-speed timer index
 };
 
+//-----------------------------------------------------------------------------
+
+#if defined(CONFIG_MLAB_HEATER_DITHER) && CONFIG_MLAB_HEATER_DITHER
+/* Called from the esp_timer task. The setter writes the integer part
+   directly, so this only has to carry the fraction; the register is only
+   touched when the duty actually changes. */
+static void heater_dither_callback(void *arg)
+{
+    uint32_t level = heater_level;
+    uint32_t duty;
+
+    // the fade owns the duty until it completes
+    if (heater_fading)
+        return;
+
+    heater_dither_acc += (level & HEATER_DITHER_MASK);
+    duty = ((level >> HEATER_DITHER_BITS) + (heater_dither_acc >> HEATER_DITHER_BITS));
+    heater_dither_acc &= HEATER_DITHER_MASK;
+
+    if (duty != ledc_get_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL)) {
+        ledc_set_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL, duty);
+        ledc_update_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL);
+    }
+}
+#endif // CONFIG_MLAB_HEATER_DITHER
+
+//-----------------------------------------------------------------------------
+
+// Whole duty count for a heater level, noting any fraction for the dither
+static uint32_t heater_duty(float level)
+{
+#if defined(CONFIG_MLAB_HEATER_DITHER) && CONFIG_MLAB_HEATER_DITHER
+    heater_level = (uint32_t)((level * (1U << HEATER_DITHER_BITS)) + 0.5f);
+    return (heater_level >> HEATER_DITHER_BITS);
+#else
+    return (uint32_t)(level + 0.5f);
+#endif // CONFIG_MLAB_HEATER_DITHER
+}
+
+static void heater_fade(ledc_channel_t channel, uint32_t duty)
+{
+    ledc_set_fade_with_time(LEDC_HS_MODE, channel, duty, HEATER_FADE_MS);
+    ledc_fade_start(LEDC_HS_MODE, channel, LEDC_FADE_NO_WAIT);
+}
+
+static void heater_commit(void);
+
+/* Runs on the esp_timer task once the falling channel has faded: starts the
+   rising channel, then once that has faded too ends the commit. */
+static void heater_fade_callback(void *arg)
+{
+    int heater_up, fan_up;
+
+    portENTER_CRITICAL(&heater_mux);
+    heater_up = heater_rising;
+    fan_up = fan_rising;
+    heater_rising = -1;
+    fan_rising = -1;
+    portEXIT_CRITICAL(&heater_mux);
+
+    if ((heater_up >= 0) || (fan_up >= 0)) {
+        if (heater_up >= 0)
+            heater_fade(LEDC_HS_CH0_CHANNEL, heater_up);
+        if (fan_up >= 0)
+            heater_fade(LEDC_HS_CH1_CHANNEL, fan_up);
+        esp_timer_start_once(heater_fade_timer, (HEATER_FADE_MS * 1000));
+        return;
+    }
+
+    heater_fading = false;
+
+    // with no acquisition running there is no quiet hook to wait for
+    if (PROBES_IDLE == probes_get_state())
+        heater_commit();
+}
+
+// Apply any requested levels (the probes quiet hook)
+static void heater_commit(void)
+{
+    bool do_heater, do_fan;
+    float level;
+    int fan;
+    uint32_t duty, current;
+    int heater_up = -1, fan_up = -1;
+    bool falling = false;
+
+    portENTER_CRITICAL(&heater_mux);
+    do_heater = (heater_pending && !heater_fading);
+    do_fan = (fan_pending && !heater_fading);
+    if (do_heater || do_fan) {
+        heater_fading = true;
+        heater_pending = false;
+        fan_pending = false;
+    }
+    level = heater_target;
+    fan = fan_target;
+    portEXIT_CRITICAL(&heater_mux);
+
+    if (!do_heater && !do_fan)
+        return;
+
+    if (do_heater) {
+        duty = heater_duty(level);
+        current = ledc_get_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL);
+        if (duty < current) {
+            heater_fade(LEDC_HS_CH0_CHANNEL, duty);
+            falling = true;
+        } else if (duty > current) {
+            heater_up = duty;
+        }
+    }
+    if (do_fan) {
+        current = ledc_get_duty(LEDC_HS_MODE, LEDC_HS_CH1_CHANNEL);
+        if ((uint32_t)fan < current) {
+            heater_fade(LEDC_HS_CH1_CHANNEL, fan);
+            falling = true;
+        } else if ((uint32_t)fan > current) {
+            fan_up = fan;
+        }
+    }
+
+    portENTER_CRITICAL(&heater_mux);
+    heater_rising = heater_up;
+    fan_rising = fan_up;
+    portEXIT_CRITICAL(&heater_mux);
+
+    if (falling)
+        esp_timer_start_once(heater_fade_timer, (HEATER_FADE_MS * 1000));
+    else
+        heater_fade_callback(NULL);
+}
+
 //-----------------------------------------------------------------------------
 // Initialize the heater
 //
@@ -59,6 +253,14 @@ void heater_init(void){
             .hpoint     = 0,
             .timer_sel  = LEDC_HS_TIMER
         },
+        {
+            .channel    = LEDC_HS_CH1_CHANNEL,
+            .duty       = 0,
+            .gpio_num   = LEDC_HS_CH1_GPIO,
+            .speed_mode = LEDC_HS_MODE,
+            .hpoint     = 0,
+            .timer_sel  = LEDC_HS_TIMER
+        },
     };
 
     // Set LED Controller with different channels configurations
@@ -67,6 +269,34 @@ void heater_init(void){
         ledc_set_duty(ledc_channel[ch].speed_mode, ledc_channel[ch].channel, LEDC_TEST_DUTY);
         ledc_update_duty(ledc_channel[ch].speed_mode, ledc_channel[ch].channel);
     }
+
+    ledc_fade_func_install(0);
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = heater_fade_callback,
+            .name = "heater_fade"
+        };
+        if (ESP_OK != esp_timer_create(&timer_args, &heater_fade_timer)) {
+            ESP_LOGE(p_tag,"Failed to create fade timer");
+        }
+    }
+    probes_set_quiet_hook(heater_commit);
+
+#if defined(CONFIG_MLAB_HEATER_DITHER) && CONFIG_MLAB_HEATER_DITHER
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = heater_dither_callback,
+            .name = "heater_dither"
+        };
+        esp_err_t ret = esp_timer_create(&timer_args, &heater_dither_timer);
+
+        if (ESP_OK == ret)
+            ret = esp_timer_start_periodic(heater_dither_timer, HEATER_DITHER_PERIOD_US);
+        if (ESP_OK != ret) {
+            ESP_LOGE(p_tag,"Failed to start dither timer (%s): whole duty counts only",esp_err_to_name(ret));
+        }
+    }
+#endif // CONFIG_MLAB_HEATER_DITHER
 }
 
 // Set the heater level. Level must be between 0 and LEDC_MAX_DUTY (8192)
@@ -75,10 +305,177 @@ int heater_set(int level) {
     if ((level < 0) || (level > LEDC_MAX_DUTY))
         return -1;
 
-    ledc_set_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL, level);
+    return heater_set_fine((float)level);
+}
+
+// Set a fractional heater level. Without dithering it is rounded.
+//
+int heater_set_fine(float level) {
+    uint32_t duty;
+
+    if ((level < 0) || (level > LEDC_MAX_DUTY))
+        return -1;
+
+    // supersedes any request not yet committed
+    portENTER_CRITICAL(&heater_mux);
+    heater_pending = false;
+    heater_rising = -1;
+    portEXIT_CRITICAL(&heater_mux);
+
+    duty = heater_duty(level);
+    ledc_set_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL, duty);
     ledc_update_duty(LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL);
     return 0;
 }
 
+// Set the fan level. Level must be between 0 and LEDC_MAX_DUTY (8192)
+//
+int fan_set(int level) {
+    if ((level < 0) || (level > LEDC_MAX_DUTY))
+        return -1;
+
+    // supersedes any request not yet committed
+    portENTER_CRITICAL(&heater_mux);
+    fan_pending = false;
+    fan_rising = -1;
+    portEXIT_CRITICAL(&heater_mux);
+
+    ledc_set_duty(LEDC_HS_MODE, LEDC_HS_CH1_CHANNEL, level);
+    ledc_update_duty(LEDC_HS_MODE, LEDC_HS_CH1_CHANNEL);
+    return 0;
+}
+
+// Request a heater level for the next quiet window
+//
+int heater_request(float level) {
+    if ((level < 0) || (level > LEDC_MAX_DUTY))
+        return -1;
+
+    portENTER_CRITICAL(&heater_mux);
+    heater_target = level;
+    heater_pending = true;
+    portEXIT_CRITICAL(&heater_mux);
+
+    // with no acquisition running there is no quiet hook to wait for
+    if (PROBES_IDLE == probes_get_state())
+        heater_commit();
+    return 0;
+}
+
+// Request a fan level for the next quiet window
+//
+int fan_request(int level) {
+    if ((level < 0) || (level > LEDC_MAX_DUTY))
+        return -1;
+
+    portENTER_CRITICAL(&heater_mux);
+    fan_target = level;
+    fan_pending = true;
+    portEXIT_CRITICAL(&heater_mux);
+
+    if (PROBES_IDLE == probes_get_state())
+        heater_commit();
+    return 0;
+}
+
+// Add the switching edges of a channel, in microseconds into the PWM period
+//
+static unsigned int heater_edges(ledc_channel_t channel, uint32_t *p_edges)
+{
+    uint32_t duty = ledc_get_duty(LEDC_HS_MODE, channel);
+    uint32_t hpoint;
+
+    // a channel held low or high does not switch
+    if ((0 == duty) || (duty >= LEDC_MAX_DUTY))
+        return 0;
+
+    hpoint = (uint32_t)ledc_get_hpoint(LEDC_HS_MODE, channel);
+    p_edges[0] = (((hpoint % LEDC_MAX_DUTY) * HEATER_PWM_PERIOD_US) / LEDC_MAX_DUTY);
+    p_edges[1] = ((((hpoint + duty) % LEDC_MAX_DUTY) * HEATER_PWM_PERIOD_US) / LEDC_MAX_DUTY);
+    return 2;
+}
+
+// Delay until a stretch of window_us without heater or fan switching edges
+//
+uint32_t heater_quiet_delay(uint32_t window_us)
+{
+    uint32_t edges[4];
+    unsigned int count = 0;
+    uint32_t now, start, gap;
+    unsigned int i, j;
+
+    if (!heater_blanked)
+        count += heater_edges(LEDC_HS_CH0_CHANNEL, &edges[count]);
+    count += heater_edges(LEDC_HS_CH1_CHANNEL, &edges[count]);
+    if (0 == count)
+        return 0;
+
+    // edges as microseconds ahead of now, in order
+    now = ((LEDC.timer_group[LEDC_HS_MODE].timer[LEDC_HS_TIMER].value.timer_cnt * HEATER_PWM_PERIOD_US) / LEDC_MAX_DUTY);
+    for (i = 0; i < count; i++) {
+        uint32_t ahead = (((edges[i] + HEATER_PWM_PERIOD_US) - now) % HEATER_PWM_PERIOD_US);
+
+        for (j = i; (j > 0) && (edges[j - 1] > ahead); j--)
+            edges[j] = edges[j - 1];
+        edges[j] = ahead;
+    }
+
+    // the current gap, once clear of the edge just passed
+    gap = (HEATER_PWM_PERIOD_US - edges[count - 1]);
+    start = ((gap < HEATER_EDGE_GUARD_US) ? (HEATER_EDGE_GUARD_US - gap) : 0);
+    if (edges[0] >= (start + window_us + HEATER_EDGE_GUARD_US))
+        return start;
+
+    // otherwise the first later gap that is long enough
+    for (i = 0; i < count; i++) {
+        gap = (((i + 1) < count) ? (edges[i + 1] - edges[i]) : ((HEATER_PWM_PERIOD_US - edges[i]) + edges[0]));
+        if (gap >= (window_us + (2 * HEATER_EDGE_GUARD_US)))
+            return (edges[i] + HEATER_EDGE_GUARD_US);
+    }
+
+    return HEATER_QUIET_NONE;
+}
+
+// Hold the heater off (blank) without changing its LEDC state
+//
+void heater_blank(bool blank)
+{
+    if (blank == heater_blanked)
+        return;
+
+    if (blank) {
+        gpio_set_level(HEATER_CTRL, 0);
+        gpio_matrix_out(HEATER_CTRL, SIG_GPIO_OUT_IDX, false, false);
+    } else {
+        (void)ledc_set_pin(HEATER_CTRL, LEDC_HS_MODE, LEDC_HS_CH0_CHANNEL);
+    }
+    heater_blanked = blank;
+}
+
+// Set heating (positive) or cooling (negative) from a single demand
+//
+int heater_actuate(float demand, int *p_duty, int *p_fan) {
+    float duty = 0;
+    int fan = 0;
+
+    if ((demand < -LEDC_MAX_DUTY) || (demand > LEDC_MAX_DUTY))
+        return -1;
+
+    if (demand > 0)
+        duty = demand;
+    else if (-demand >= FAN_MIN_DUTY)
+        fan = (int)-demand;
+
+    // never run both: the commit fades the one not wanted out first
+    heater_request(duty);
+    fan_request(fan);
+
+    if (p_duty)
+        *p_duty = (int)(duty + 0.5f);
+    if (p_fan)
+        *p_fan = fan;
+    return 0;
+}
+
 //=============================================================================
 // EOF heater.c
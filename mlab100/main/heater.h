@@ -4,11 +4,27 @@
 #if !defined(_heater_)
 #define __heater_ (1)
 
-#define LEDC_TEST_CH_NUM       (1)
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LEDC_TEST_CH_NUM       (2)
 #define LEDC_MAX_DUTY          (8192)
 #define LEDC_TEST_DUTY         (0)
 #define LEDC_TEST_ZERO          (0)
 
+// lowest fan duty that keeps the fan turning; smaller cooling demands are off
+#define FAN_MIN_DUTY           (LEDC_MAX_DUTY / 4)
+
+#define HEATER_PWM_HZ          (5000)
+#define HEATER_PWM_PERIOD_US   (1000000 / HEATER_PWM_HZ)
+
+// heater_quiet_delay() result when no quiet window is long enough
+#define HEATER_QUIET_NONE      (UINT32_MAX)
+
+// highest setpoint in degrees Celsius, leaving the probe over-temperature
+// alarm above it within the DS18B20 range
+#define HEATER_SETPOINT_MAX    (110)
+
 //-----------------------------------------------------------------------------
 /**
  * Initialise the Heater device control.
@@ -17,11 +33,76 @@
 extern void heater_init(void);
 
 /**
- * Set Heater level.
+ * Set Heater level at once, superseding any uncommitted heater_request().
  *
  */
 extern int heater_set(int level);
 
+/**
+ * Set Heater level with a fractional duty count, 0 .. LEDC_MAX_DUTY. With
+ * CONFIG_MLAB_HEATER_DITHER the fraction is dithered over successive PWM
+ * periods; otherwise the level is rounded to a whole count.
+ *
+ */
+extern int heater_set_fine(float level);
+
+/**
+ * Set Fan level at once, superseding any uncommitted fan_request(). Level
+ * must be between 0 and LEDC_MAX_DUTY.
+ *
+ */
+extern int fan_set(int level);
+
+/**
+ * Request a Heater level (fractional, 0 .. LEDC_MAX_DUTY). The change is
+ * committed with a short hardware fade at the start of the next window with
+ * no 1-Wire traffic (or at once if acquisition is not running), so it cannot
+ * corrupt a probe reading. A later request before the commit replaces it.
+ *
+ */
+extern int heater_request(float level);
+
+/**
+ * Request a Fan level (0 .. LEDC_MAX_DUTY), committed as heater_request().
+ * When both change the channel being reduced fades first.
+ *
+ */
+extern int fan_request(int level);
+
+/**
+ * Drive heating and cooling as one signal. A positive demand is heater duty
+ * with the fan off; a negative demand is fan duty with the heater off, where
+ * demands below FAN_MIN_DUTY leave the fan off rather than stall it. The
+ * levels are requested with heater_request() and fan_request().
+ *
+ * @param demand -LEDC_MAX_DUTY (full cooling) .. LEDC_MAX_DUTY (full heating);
+ *               heating may be fractional (see heater_set_fine()).
+ * @param p_duty If not NULL, filled with the heater duty requested (rounded).
+ * @param p_fan If not NULL, filled with the fan duty requested.
+ * @return 0 on success, -1 if the demand is out of range.
+ */
+extern int heater_actuate(float demand, int *p_duty, int *p_fan);
+
+/**
+ * Find the next stretch of the PWM period in which neither the heater nor
+ * the fan output switches, e.g. to place ADC conversions away from the
+ * switching edges. Call from a context that can start its work promptly.
+ *
+ * @param window_us Length of the edge-free stretch needed, in microseconds.
+ * @return microseconds from now until such a stretch starts (0 if now), or
+ *         HEATER_QUIET_NONE if the current duties leave no gap that long.
+ */
+extern uint32_t heater_quiet_delay(uint32_t window_us);
+
+/**
+ * Blank the heater output for a short burst of sensitive measurements. The
+ * pin is held low while the PWM carries on underneath, so releasing it
+ * resumes the current level, including any changes requested meanwhile.
+ *
+ * @param blank true to hold the heater off, false to release it.
+ */
+extern void heater_blank(bool blank);
+
 //-----------------------------------------------------------------------------
 
 #endif // !_heater_
@@ -0,0 +1,402 @@
+// lockin.c
+//=============================================================================
+/*
+ * Lock-in (synchronous) detection of the UV LED signal.
+ *
+ * The UV LEDs are driven with a 50% square wave from their own LEDC timer
+ * while the ADC122S021 streams both channels at a whole number of samples
+ * per period (16, or fewer when the stream period is rounded to the heater
+ * PWM period, see lockin_samples()). Each sample is multiplied by a sine and a cosine
+ * reference at the modulation frequency, with the reference phase taken
+ * from the sample timestamp relative to the LEDC timer reset:
+ *
+ *   I = sum(s * sin) - sum(s) * sum(sin) / N
+ *   Q = sum(s * cos) - sum(s) * sum(cos) / N
+ *
+ * Subtracting the mean term rejects ambient light and drift exactly, even
+ * when the samples do not cover the reference phases evenly. The LED step A
+ * appears at the fundamental as A/pi in each reference, so
+ *
+ *   A = pi * sqrt(I^2 + Q^2) / N
+ *
+ * and only noise near the modulation frequency is left, falling with the
+ * square root of the integration time.
+ *
+ * The same samples are decimated by a boxcar over exactly one modulation
+ * period, which cancels the LED square wave and leaves the ambient level of
+ * each period with extra resolution. A straight line fitted to those levels
+ * gives the ambient drift over the measurement, since a reading taken while
+ * the ambient light was changing is less trustworthy.
+ */
+
+//=============================================================================
+
+#include <string.h>
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/ledc.h"
+
+#include "mlab100.h"
+#include "adc122s021.h"
+#include "heater.h"
+#include "decimate.h"
+#include "lockin.h"
+
+//-----------------------------------------------------------------------------
+
+static const char *p_tag = "lockin"; // for esp-idf logging
+
+#define LOCKIN_TASK_STACK     (3072)
+#define LOCKIN_TASK_PRIORITY  (4) // below the probe acquisition tasks
+
+// the UV LEDs use their own timer, so the heater and fan PWM are unaffected
+#define LOCKIN_LEDC_MODE      LEDC_HIGH_SPEED_MODE
+#define LOCKIN_LEDC_TIMER     LEDC_TIMER_1
+#define LOCKIN_LEDC_BITS      LEDC_TIMER_10_BIT
+#define LOCKIN_LEDC_DUTY      (1 << (LOCKIN_LEDC_BITS - 1)) // 50%
+#define LOCKIN_UV1_CHANNEL    LEDC_CHANNEL_2
+#define LOCKIN_UV2_CHANNEL    LEDC_CHANNEL_3
+
+#define LOCKIN_TABLE_BITS     (6)  // reference table of 64 points per cycle
+#define LOCKIN_TABLE_SIZE     (1 << LOCKIN_TABLE_BITS)
+#define LOCKIN_SETTLE_CYCLES  (2)  // periods ignored while the optics settle
+#define LOCKIN_BATCH          (64) // stream samples read at a time
+#define LOCKIN_BLANK_MAX_US   (1000000) // longest heater blanking, if enabled
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+    uint16_t frequency;
+    uint16_t cycles;
+    unsigned int samples_log2;  // 2^samples_log2 ADC samples per period
+} lockin_request_t;
+
+static spi_device_handle_t lockin_spi;
+static TaskHandle_t lockin_task = NULL;
+static QueueHandle_t lockin_queue = NULL;
+static volatile bool lockin_busy;
+
+static int16_t lockin_sin[LOCKIN_TABLE_SIZE]; // Q15
+
+static portMUX_TYPE lockin_mux = portMUX_INITIALIZER_UNLOCKED;
+static lockin_result_t lockin_result;
+static bool lockin_result_new;
+
+//-----------------------------------------------------------------------------
+
+static esp_err_t lockin_leds_start(uint16_t frequency, int64_t *p_t0)
+{
+    const ledc_timer_config_t timer = {
+        .duty_resolution = LOCKIN_LEDC_BITS,
+        .freq_hz = frequency,
+        .speed_mode = LOCKIN_LEDC_MODE,
+        .timer_num = LOCKIN_LEDC_TIMER
+    };
+    ledc_channel_config_t channel = {
+        .duty       = LOCKIN_LEDC_DUTY,
+        .speed_mode = LOCKIN_LEDC_MODE,
+        .hpoint     = 0,
+        .timer_sel  = LOCKIN_LEDC_TIMER
+    };
+    esp_err_t ret;
+
+    ret = ledc_timer_config(&timer);
+    if (ESP_OK == ret) {
+        channel.channel = LOCKIN_UV1_CHANNEL;
+        channel.gpio_num = UV1_LED;
+        ret = ledc_channel_config(&channel);
+    }
+    if (ESP_OK == ret) {
+        channel.channel = LOCKIN_UV2_CHANNEL;
+        channel.gpio_num = UV2_LED;
+        ret = ledc_channel_config(&channel);
+    }
+    if (ESP_OK == ret) {
+        // phase zero (LEDs switching on) is the timer reset
+        ret = ledc_timer_rst(LOCKIN_LEDC_MODE, LOCKIN_LEDC_TIMER);
+        *p_t0 = esp_timer_get_time();
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+static void lockin_leds_stop(void)
+{
+    // leave the LEDs on, as configured at startup
+    (void)ledc_stop(LOCKIN_LEDC_MODE, LOCKIN_UV1_CHANNEL, 1);
+    (void)ledc_stop(LOCKIN_LEDC_MODE, LOCKIN_UV2_CHANNEL, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+static void lockin_measure(const lockin_request_t *p_request, lockin_result_t *p_result)
+{
+    static adc122s021_stream_sample_t batch[LOCKIN_BATCH];
+    static uint16_t samples[2][LOCKIN_BATCH];
+    static int32_t levels[(LOCKIN_BATCH >> LOCKIN_SAMPLES_LOG2_MIN) + 1];
+    const uint32_t rate = ((uint32_t)p_request->frequency << p_request->samples_log2);
+    const uint32_t wanted = ((uint32_t)p_request->cycles << p_request->samples_log2);
+    const int64_t period_us = (1000000 / p_request->frequency);
+    const TickType_t wait = ((pdMS_TO_TICKS(10) > 0) ? pdMS_TO_TICKS(10) : 1);
+    const int64_t timeout = (esp_timer_get_time() + (2 * (LOCKIN_SETTLE_CYCLES + p_request->cycles) * period_us) + 1000000);
+    adc122s021_stream_stats_t stats;
+    int64_t sum[2] = { 0, 0 };
+    int64_t sum_i[2] = { 0, 0 };
+    int64_t sum_q[2] = { 0, 0 };
+    int64_t ref_i = 0;
+    int64_t ref_q = 0;
+    uint32_t count = 0;
+    int64_t t0 = 0;
+    decimate_t dec[2];
+    int64_t level_sum[2] = { 0, 0 };   // per-period levels, for the drift fit
+    int64_t level_moment[2] = { 0, 0 };
+    uint32_t periods = 0;
+    unsigned int ch;
+
+    memset(p_result,'\0',sizeof(*p_result));
+    p_result->frequency = p_request->frequency;
+    for (ch = 0; ch < 2; ch++)
+        (void)decimate_init(&dec[ch], 1, p_request->samples_log2, NULL, 0);
+
+    if (ESP_OK != lockin_leds_start(p_request->frequency, &t0)) {
+        ESP_LOGE(p_tag,"Failed to modulate the UV LEDs at %u Hz",p_request->frequency);
+        lockin_leds_stop();
+        return;
+    }
+#if defined(CONFIG_MLAB_LOCKIN_BLANK_HEATER) && CONFIG_MLAB_LOCKIN_BLANK_HEATER
+    // a short burst can do without the heater, and its switching noise
+    bool blank = (((LOCKIN_SETTLE_CYCLES + p_request->cycles) * period_us) <= LOCKIN_BLANK_MAX_US);
+    if (blank)
+        heater_blank(true);
+#endif // CONFIG_MLAB_LOCKIN_BLANK_HEATER
+
+    if (ESP_OK != adc122s021_stream_start(lockin_spi, rate)) {
+#if defined(CONFIG_MLAB_LOCKIN_BLANK_HEATER) && CONFIG_MLAB_LOCKIN_BLANK_HEATER
+        if (blank)
+            heater_blank(false);
+#endif // CONFIG_MLAB_LOCKIN_BLANK_HEATER
+        lockin_leds_stop();
+        return;
+    }
+
+    while ((count < wanted) && (esp_timer_get_time() < timeout)) {
+        size_t n = adc122s021_stream_read(batch, LOCKIN_BATCH);
+        size_t used = 0;
+        size_t levels_n = 0;
+        size_t i;
+
+        if (0 == n) {
+            vTaskDelay(wait);
+            continue;
+        }
+
+        for (i = 0; (i < n) && (count < wanted); i++) {
+            int64_t elapsed = (batch[i].timestamp - t0);
+            uint32_t index;
+            int32_t s_ref;
+            int32_t c_ref;
+
+            if (elapsed < (LOCKIN_SETTLE_CYCLES * period_us))
+                continue;
+
+            // reference phase of this sample, as the nearest table index
+            index = (uint32_t)((((elapsed * p_request->frequency * LOCKIN_TABLE_SIZE) + 500000) / 1000000) & (LOCKIN_TABLE_SIZE - 1));
+            s_ref = lockin_sin[index];
+            c_ref = lockin_sin[(index + (LOCKIN_TABLE_SIZE / 4)) & (LOCKIN_TABLE_SIZE - 1)];
+
+            sum[0] += batch[i].in1;
+            sum[1] += batch[i].in2;
+            sum_i[0] += ((int32_t)batch[i].in1 * s_ref);
+            sum_i[1] += ((int32_t)batch[i].in2 * s_ref);
+            sum_q[0] += ((int32_t)batch[i].in1 * c_ref);
+            sum_q[1] += ((int32_t)batch[i].in2 * c_ref);
+            ref_i += s_ref;
+            ref_q += c_ref;
+            count++;
+
+            samples[0][used] = batch[i].in1;
+            samples[1][used] = batch[i].in2;
+            used++;
+        }
+
+        for (ch = 0; ch < 2; ch++) {
+            size_t k;
+
+            levels_n = decimate_process(&dec[ch], samples[ch], used, levels);
+            for (k = 0; k < levels_n; k++) {
+                level_sum[ch] += levels[k];
+                level_moment[ch] += ((int64_t)(periods + k) * levels[k]);
+            }
+        }
+        periods += levels_n;
+    }
+
+    adc122s021_stream_stop();
+    adc122s021_stream_get_stats(&stats);
+#if defined(CONFIG_MLAB_LOCKIN_BLANK_HEATER) && CONFIG_MLAB_LOCKIN_BLANK_HEATER
+    if (blank)
+        heater_blank(false);
+#endif // CONFIG_MLAB_LOCKIN_BLANK_HEATER
+    lockin_leds_stop();
+
+    p_result->samples = count;
+    p_result->dropped = stats.dropped;
+    if (0 == count)
+        return;
+
+    for (ch = 0; ch < 2; ch++) {
+        float i_val = (((float)sum_i[ch] - (((float)sum[ch] * (float)ref_i) / count)) / 32768.0f);
+        float q_val = (((float)sum_q[ch] - (((float)sum[ch] * (float)ref_q) / count)) / 32768.0f);
+
+        p_result->amplitude[ch] = (((float)M_PI * sqrtf((i_val * i_val) + (q_val * q_val))) / count);
+        p_result->phase[ch] = atan2f(-q_val, i_val);
+        p_result->ambient[ch] = ((float)sum[ch] / count);
+
+        /* Least-squares slope of the period levels against the period index
+           k = 0..n-1, where sum(k) = n(n-1)/2 and the sum of the squared
+           deviations of k is n(n^2-1)/12, scaled to the whole measurement. */
+        if (periods > 1) {
+            double n = periods;
+            double slope = ((((double)level_moment[ch] - (((n - 1) / 2) * (double)level_sum[ch])) * 12) / (n * ((n * n) - 1)));
+
+            p_result->drift[ch] = (float)((slope * (n - 1)) / (1 << DECIMATE_FRAC_BITS));
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static void lockin_worker(void *p_arg)
+{
+    lockin_request_t request;
+    lockin_result_t result;
+
+    for (;;) {
+        if (pdTRUE != xQueueReceive(lockin_queue, &request, portMAX_DELAY))
+            continue;
+
+        lockin_measure(&request, &result);
+        ESP_LOGI(p_tag,"%u Hz x %u: IN1 %.3f (ambient %.1f drift %.2f) IN2 %.3f (ambient %.1f drift %.2f) counts, %u samples, %u dropped",result.frequency,request.cycles,result.amplitude[0],result.ambient[0],result.drift[0],result.amplitude[1],result.ambient[1],result.drift[1],result.samples,result.dropped);
+
+        portENTER_CRITICAL(&lockin_mux);
+        lockin_result = result;
+        lockin_result_new = true;
+        portEXIT_CRITICAL(&lockin_mux);
+        lockin_busy = false;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t lockin_init(spi_device_handle_t spi)
+{
+    unsigned int i;
+
+    if (lockin_task)
+        return ESP_OK;
+
+    for (i = 0; i < LOCKIN_TABLE_SIZE; i++)
+        lockin_sin[i] = (int16_t)lroundf(32767.0f * sinf((2.0f * (float)M_PI * i) / LOCKIN_TABLE_SIZE));
+
+    lockin_spi = spi;
+    lockin_queue = xQueueCreate(1, sizeof(lockin_request_t));
+    if (NULL == lockin_queue)
+        return ESP_ERR_NO_MEM;
+
+    if (pdPASS != xTaskCreate(lockin_worker, "lockin", LOCKIN_TASK_STACK, NULL, LOCKIN_TASK_PRIORITY, &lockin_task)) {
+        ESP_LOGE(p_tag,"Failed to create measurement task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+/* The most samples per modulation period, as a power of two, for which the
+   stream period the ADC will actually use (it may be rounded to the heater PWM
+   period) makes that many samples span one period to within 0.5%. The drift
+   decimator needs this to cancel the LED square wave, and the sample count and
+   timeout of a measurement are derived from it. Returns -1 if none does. */
+
+static int lockin_samples(uint16_t frequency)
+{
+    int log2;
+
+    for (log2 = LOCKIN_SAMPLES_LOG2_MAX; log2 >= LOCKIN_SAMPLES_LOG2_MIN; log2--) {
+        uint32_t period_us = adc122s021_stream_period((uint32_t)frequency << log2);
+        int64_t error;
+
+        if (0 == period_us)
+            continue;
+        error = ((((int64_t)period_us << log2) * frequency) - 1000000);
+        if ((error >= -5000) && (error <= 5000))
+            return log2;
+    }
+
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t lockin_start(uint16_t frequency, uint16_t cycles)
+{
+    lockin_request_t request = {
+        .frequency = frequency,
+        .cycles = cycles
+    };
+    int log2;
+
+    if ((NULL == lockin_queue) || (frequency < LOCKIN_FREQUENCY_MIN) || (frequency > LOCKIN_FREQUENCY_MAX) || (0 == cycles))
+        return ESP_ERR_INVALID_ARG;
+    if (lockin_busy)
+        return ESP_ERR_INVALID_STATE;
+
+    log2 = lockin_samples(frequency);
+    if (log2 < 0) {
+        ESP_LOGW(p_tag,"No ADC stream rate fits a whole number of samples in a %u Hz period",frequency);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    request.samples_log2 = (unsigned int)log2;
+
+    lockin_busy = true;
+    if (pdTRUE != xQueueSend(lockin_queue, &request, 0)) {
+        lockin_busy = false;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+bool lockin_active(void)
+{
+    return lockin_busy;
+}
+
+//-----------------------------------------------------------------------------
+
+bool lockin_get_result(lockin_result_t *p_result)
+{
+    bool available;
+
+    portENTER_CRITICAL(&lockin_mux);
+    available = lockin_result_new;
+    if (available) {
+        *p_result = lockin_result;
+        lockin_result_new = false;
+    }
+    portEXIT_CRITICAL(&lockin_mux);
+
+    return available;
+}
+
+//=============================================================================
+// EOF lockin.c
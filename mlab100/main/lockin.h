@@ -0,0 +1,91 @@
+// lockin.h
+//=============================================================================
+
+#if !defined(__lockin_h)
+#define __lockin_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "driver/spi_master.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define LOCKIN_SAMPLES_LOG2_MAX  (4)    // up to 16 ADC samples per modulation period
+#define LOCKIN_SAMPLES_LOG2_MIN  (2)    // and at least 4
+#define LOCKIN_FREQUENCY_MIN     (10)   // Hz
+#define LOCKIN_FREQUENCY_MAX     (625)  // Hz, limited by the ADC stream rate
+#define LOCKIN_FREQUENCY_DEFAULT (125)  // Hz, away from mains harmonics
+#define LOCKIN_CYCLES_DEFAULT    (250)  // modulation periods per measurement
+
+// Result of one measurement, per ADC channel (0 IN1, 1 IN2)
+typedef struct {
+    uint16_t frequency;     // modulation frequency in Hz
+    uint32_t samples;       // ADC samples demodulated
+    uint32_t dropped;       // samples lost by the ADC stream
+    float amplitude[2];     // LED on/off step in ADC counts
+    float phase[2];         // lag of the response behind the LED drive, in radians (coarse)
+    float ambient[2];       // mean (unmodulated) level in ADC counts
+    float drift[2];         // change in the mean level over the measurement, in ADC counts
+} lockin_result_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise lock-in detection. Measurements run in their own task.
+ *
+ * @param spi Handle onto the ADC122S021 device.
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t lockin_init(spi_device_handle_t spi);
+
+/**
+ * Start a measurement. The UV LEDs are square-wave modulated at the given
+ * frequency while both ADC channels are streamed and demodulated against
+ * the drive, rejecting ambient light and slow drift. The LEDs are left on
+ * afterwards.
+ *
+ * @param frequency Modulation frequency in Hz (LOCKIN_FREQUENCY_MIN..MAX).
+ * @param cycles Number of modulation periods to integrate.
+ * @return ESP_OK if started, ESP_ERR_INVALID_STATE if a measurement is running,
+ *         ESP_ERR_NOT_SUPPORTED if no ADC stream rate (after any rounding to
+ *         the heater PWM period) gives a whole number of samples per period.
+ */
+extern esp_err_t lockin_start(uint16_t frequency, uint16_t cycles);
+
+/**
+ * Check for a measurement in progress, which owns the UV LEDs and the ADC
+ * stream.
+ *
+ * @return true from lockin_start() until its result is available.
+ */
+extern bool lockin_active(void);
+
+/**
+ * Collect the result of the last measurement, once.
+ *
+ * @param p_result Filled with the result.
+ * @return true if a new result was available.
+ */
+extern bool lockin_get_result(lockin_result_t *p_result);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__lockin_h
+
+//=============================================================================
+// EOF lockin.h
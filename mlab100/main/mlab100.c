@@ -15,8 +15,10 @@
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 
 #include "esp_types.h"
 #include "esp_system.h"
@@ -24,10 +26,12 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 
 #include "esp_log.h"
 #include "esp_spi_flash.h"
+#include "esp_timer.h"
 
 #include "nvs_flash.h"
 #include "soc/efuse_reg.h"
@@ -46,6 +50,13 @@
 #include "ds18b20.h"
 #include "heater.h"
 #include "onewire.h"
+#include "probes.h"
+#include "autotune.h"
+#include "thermal.h"
+#include "mpc.h"
+#include "cascade.h"
+#include "profile.h"
+#include "lockin.h"
 
 #include "mlab_blufi.h"
 #include "mlab_webserver.h"
@@ -59,14 +70,108 @@ const char * const p_model = MLAB_MODEL; // H/W model identifier
 const char * const p_version = STRINGIFY(MLAB_VERSION); // F/W version identifier
 const char * const p_device = "MLAB" MLAB_MODEL; // Human-readable device name
 
-static onewire_search_t onewire_ds;
-#define MAX_SENSORS 3
-static onewire_addr_t sensors[MAX_SENSORS];
 
-static  TickType_t xLastWakeTime;
+#define LOOP_FREQUENCY  (CONFIG_MLAB_CONTROL_PERIOD_MS) // control period in milliseconds
+
+/* The control loop runs in its own task on the APP CPU, woken by a periodic
+   esp_timer. The networking stacks are pinned to the PRO CPU, so their bursts
+   cannot delay a control cycle. It sits just below the cascade inner loop,
+   which has the tighter deadline.
+
+   The task blocks on a queue set, so it also wakes at once for received
+   appdata (parsed in milliseconds rather than at the next cycle) and for each
+   new set of probe readings (checked against the alarm thresholds straight
+   away). Only the timer runs a control cycle, so the cadence is unchanged. */
+#define CONTROL_TASK_STACK      (4096)
+#define CONTROL_TASK_PRIORITY   (9)
+#define CONTROL_TASK_CORE       (APP_CPU_NUM)
+#define CONTROL_REPORT_CYCLES   (30) // timing telemetry interval
+
+// Control loop timing, written by the control task (overruns by the timer callback)
+typedef struct {
+    uint32_t cycles;        // control cycles run
+    volatile uint32_t overruns; // timer periods that elapsed with the previous one still pending
+    int32_t jitter_us;      // wake time of the latest cycle relative to its schedule
+    int32_t jitter_max_us;  // worst absolute jitter seen
+    uint32_t run_us;        // execution time of the latest cycle
+    uint32_t run_max_us;    // worst execution time seen
+} control_stats_t;
+
+static TaskHandle_t control_task = NULL;
+static esp_timer_handle_t control_timer;
+static QueueSetHandle_t control_events = NULL; // queue_appdata, control_tick and control_ready
+static SemaphoreHandle_t control_tick = NULL;  // given every control period
+static SemaphoreHandle_t control_ready = NULL; // given for each new set of probe readings
+static portMUX_TYPE control_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t control_due_us; // scheduled time of the latest period, guarded by control_mux
+static control_stats_t control_stats;
+
+// probe alarm threshold above the setpoint that forces the heater off
+#define OVERTEMP_MARGIN (10)
+
+// longest wait for the first probe readings before starting without them
+#define STARTUP_PROBES_TIMEOUT_MS (10 * 1000)
+
+/* Default PID gains, in duty counts per degree. The output is heater duty
+   when positive and fan duty when negative (see heater_actuate()). Full power
+   below 5 degrees of error, with the integral trimming the remaining offset
+   over about a minute. */
+#define PID_KP  (LEDC_MAX_DUTY / 5.0)
+#define PID_KI  (PID_KP / 60.0)
+#define PID_KD  (PID_KP * 2.0)
+
+// Relay auto-tune: full on/off swing, band above the 12-bit probe noise
+#define AUTOTUNE_BAND       (0.25)
+#define AUTOTUNE_TIMEOUT_S  (2 * 60 * 60)
 
 static heater_t heater;
 static float last_temperature;  // used to calculate the gradient
+static int64_t last_temperature_us;  // when last_temperature was measured
+
+// consecutive cycles without a valid reading before the heater is turned off
+#define FAILED_READINGS_MAX (5)
+static unsigned int failed_readings;
+
+/* Online thermal model of the block, fitted every control cycle. The dead
+   time is an initial guess at the heater-to-probe transport delay. */
+#define THERMAL_DELAY         (5)     // initial dead time in samples, then estimated
+#define THERMAL_LAMBDA        (0.995) // forgetting factor: ~200 sample memory
+#define THERMAL_REPORT_CYCLES (30)    // telemetry interval
+
+static thermal_model_t thermal;
+
+/* Model-predictive control. Until the model has seen enough samples (and is
+   a stable lag) the PID controller is used instead. The switching cost is
+   relative to one degree squared of error per sample. */
+#define MPC_MIN_UPDATES     (2 * THERMAL_DELAY_MAX)
+#define MPC_SWITCH_WEIGHT   (2.0)
+#define MPC_ENERGY_WEIGHT   (0.01)
+
+static mpc_t mpc;
+
+/* Cascade control. The inner loop regulates an analog sensor on the
+   ADC122S021 at 100Hz; the probes (outer loop) trim its setpoint by up to
+   CASCADE_TRIM to remove any offset between the sensor and the block. The
+   sensor calibration is a linear full-scale span and zero offset. */
+#define CASCADE_ADC_CHANNEL  (0)     // IN1
+#define CASCADE_ADC_SCALE    (100.0) // degrees Celsius at full scale
+#define CASCADE_ADC_OFFSET   (0.0)   // degrees Celsius at zero
+#define CASCADE_INNER_KP     (LEDC_MAX_DUTY / 2.0)
+#define CASCADE_INNER_KI     (CASCADE_INNER_KP / 5.0)
+#define CASCADE_INNER_KD     (0.0)
+#define CASCADE_OUTER_KP     (1.0)
+#define CASCADE_OUTER_KI     (CASCADE_OUTER_KP / 60.0)
+#define CASCADE_TRIM         (20.0)
+
+static pid_controller_t cascade_outer;
+
+/* The model works relative to the ambient probe, when one is nominated, so
+   ambient changes feed forward into the predictions instead of having to be
+   learnt as a change of model offset. */
+static float ambient;
+
+// over-temperature alarm threshold currently programmed into the probes
+static int8_t alarm_high;
 
 //-----------------------------------------------------------------------------
 
@@ -82,6 +187,14 @@ typedef struct ml_app_tuple {
 
 // "code" values:
 #define OPCODE_EXTENSION (0x00) // use next byte for "code"
+#define OPCODE_HEATER_MODE (0x01) // data: uint8_t heater_mode_t
+#define OPCODE_PID_GAINS (0x02) // data: float kp, ki, kd (little-endian); reported with the gains in effect
+#define OPCODE_AUTOTUNE (0x03) // start auto-tune; reported with data: uint8_t autotune_state_t, uint8_t percent
+#define OPCODE_THERMAL_MODEL (0x04) // reported with data: thermal_params_t (float tau, gain, fan_gain, offset, dead_time)
+#define OPCODE_AMBIENT_PROBE (0x05) // data: uint8_t bus, uint64_t rom (little-endian), or none to clear; reported with the probe in effect
+#define OPCODE_PROFILE (0x06) // data: profile_header_t and profile_step_t entries (see profile.h)
+#define OPCODE_PROFILE_RUN (0x07) // data: uint8_t 1 to start, 0 to stop; reported with data: uint8_t profile_phase_t, uint8_t step
+#define OPCODE_LOCKIN (0x08) // data: uint16_t Hz, uint16_t cycles (little-endian), or none for defaults; reported with data: float amplitude IN1, IN2, float ambient IN1, IN2, float drift IN1, IN2 (ADC counts)
 /* TODO:DEFINE: initial set of requests/actions/data we need to pass between the Client and Server implementations. */
 // all other codes are currently undefined and IGNORED
 
@@ -154,15 +267,348 @@ void mlab_app_data(const uint8_t *p_buffer,uint32_t blen)
 //-----------------------------------------------------------------------------
 // Used in the heater controller
 
-// Get the average heater temperature in Celsius from sensors
-static float get_temperature(void) {
+// Get the average heater temperature in Celsius from the latest completed
+// probe acquisition. This never waits on the 1-Wire bus. The ambient probe,
+// if one is nominated, is excluded and its reading updates "ambient".
+// Returns false, leaving *p_temperature alone, if there is no recent reading
+// with at least one CRC-validated heater probe.
+static bool get_temperature(float *p_temperature) {
+    probes_reading_t reading;
+    probe_addr_t ambient_probe;
+    bool has_ambient = probes_get_ambient(&ambient_probe);
     float res = 0.;
-    int i;
+    unsigned int valid = 0;
+    unsigned int i;
 
-    for (i = 0; i < MAX_SENSORS; i++)
-        res += ds18b20_get_temp(sensors[i]);
+    if (!probes_get_latest(&reading) || (0 == reading.valid))
+        return false;
 
-    return (res / MAX_SENSORS);
+    if ((esp_timer_get_time() - reading.timestamp) > (2 * LOOP_FREQUENCY * 1000)) {
+        ESP_LOGW(p_tag,"Stale probe reading #%u",reading.sequence);
+        return false;
+    }
+
+    // only CRC-validated readings contribute
+    for (i = 0; i < reading.count; i++) {
+        if (reading.valid & (1 << i)) {
+            if (has_ambient && (reading.addrs[i].bus == ambient_probe.bus) && (reading.addrs[i].rom == ambient_probe.rom)) {
+                ambient = reading.temps[i];
+            } else {
+                res += reading.temps[i];
+                valid++;
+            }
+        }
+    }
+
+    if (0 == valid)
+        return false;
+
+    *p_temperature = (res / valid);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// The MPC mode needs a fitted, stable thermal model
+
+static bool heater_model_ready(void)
+{
+    thermal_params_t params;
+
+    return ((thermal.updates >= MPC_MIN_UPDATES) && thermal_get_params(&thermal,&params));
+}
+
+//-----------------------------------------------------------------------------
+// Send a single tuple to the Client
+
+static void app_main_send(uint8_t code,const void *p_data,uint8_t dlen)
+{
+#if defined(CONFIG_MLAB_BLUFI) && CONFIG_MLAB_BLUFI
+    uint8_t buffer[2 + UINT8_MAX];
+
+    if (dlen > (UINT8_MAX - 1))
+        return;
+
+    buffer[0] = (1 + dlen);
+    buffer[1] = code;
+    (void)memcpy(&buffer[2],p_data,dlen);
+    if (ESP_OK != mlab_app_data_send(buffer,(2 + dlen))) {
+        ESP_LOGD(p_tag,"Tuple code 0x%02X not sent",code);
+    }
+#endif // CONFIG_MLAB_BLUFI
+    return;
+}
+
+static void app_main_send_gains(void)
+{
+    float gains[3];
+
+    gains[0] = heater.pid.kp;
+    gains[1] = heater.pid.ki;
+    gains[2] = heater.pid.kd;
+    app_main_send(OPCODE_PID_GAINS,gains,sizeof(gains));
+}
+
+static void app_main_send_ambient(void)
+{
+    probe_addr_t probe;
+    uint8_t report[1 + sizeof(uint64_t)];
+
+    if (probes_get_ambient(&probe)) {
+        report[0] = (uint8_t)probe.bus;
+        (void)memcpy(&report[1],&probe.rom,sizeof(probe.rom));
+        app_main_send(OPCODE_AMBIENT_PROBE,report,sizeof(report));
+    } else {
+        app_main_send(OPCODE_AMBIENT_PROBE,report,0);
+    }
+}
+
+static void app_main_send_autotune(void)
+{
+    uint8_t report[2];
+
+    report[0] = heater.autotune.state;
+    report[1] = autotune_progress(&heater.autotune);
+    app_main_send(OPCODE_AUTOTUNE,report,sizeof(report));
+}
+
+static void app_main_send_profile(void)
+{
+    profile_status_t status;
+    uint8_t report[2];
+
+    profile_get_status(&status);
+    report[0] = status.phase;
+    report[1] = status.step;
+    app_main_send(OPCODE_PROFILE_RUN,report,sizeof(report));
+}
+
+//-----------------------------------------------------------------------------
+// Probe alarm threshold for a setpoint, clamped to what a DS18B20 can hold
+
+static int8_t heater_alarm_high(float setpoint)
+{
+    float high = (setpoint + OVERTEMP_MARGIN);
+
+    if (!(high >= DS18B20_TEMP_MIN))
+        high = DS18B20_TEMP_MIN;
+    else if (high > DS18B20_TEMP_MAX)
+        high = DS18B20_TEMP_MAX;
+    return (int8_t)high;
+}
+
+//-----------------------------------------------------------------------------
+// Change the setpoint, moving the probe alarm threshold with it
+
+static void heater_set_setpoint(float setpoint)
+{
+    int8_t high = heater_alarm_high(setpoint);
+
+    heater.setpoint = setpoint;
+    if (high != alarm_high) {
+        probes_set_alarm(high, DS18B20_TEMP_MIN);
+        alarm_high = high;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static void heater_set_mode(heater_mode_t mode)
+{
+    if (mode == heater.mode)
+        return;
+
+    ESP_LOGI(p_tag,"Heater mode %s",MODE2STR(mode));
+    if (HEATER_MODE_CASCADE == heater.mode) {
+        // take the heater back from the inner loop
+        cascade_stop();
+    }
+    if (HEATER_MODE_CASCADE == mode) {
+        // the inner loop starts from the current duty on the next cycle
+        pid_reset(&cascade_outer, heater.setpoint, heater.temperature, 0);
+    } else if ((HEATER_MODE_PID == mode) || (HEATER_MODE_MPC == mode)) {
+        // bumpless: the controller starts from the outputs currently applied
+        pid_reset(&heater.pid, heater.setpoint, heater.temperature, (heater.duty ? heater.duty : -heater.fan));
+        mpc.u = ((float)heater.duty / LEDC_MAX_DUTY);
+        mpc.fan = ((float)heater.fan / LEDC_MAX_DUTY);
+    } else if (HEATER_MODE_AUTOTUNE == mode) {
+        autotune_start(&heater.autotune, heater.setpoint, 0, LEDC_MAX_DUTY, AUTOTUNE_BAND, AUTOTUNE_TIMEOUT_S, esp_timer_get_time());
+        fan_request(0);
+        heater.fan = 0;
+        app_main_send_autotune();
+    } else if (HEATING == heater.state) {
+        // on/off switching continues from full or zero duty
+        HEATER_ON();
+    } else {
+        HEATER_OFF();
+        if (IDLE != heater.state)
+            heater.state = COOLING;
+    }
+    heater.mode = mode;
+}
+
+//-----------------------------------------------------------------------------
+// Adopt the result of an auto-tune experiment and return to PID control
+
+static void heater_autotune_finish(void)
+{
+    float gains[3];
+
+    if (autotune_gains(&heater.autotune,&gains[0],&gains[1],&gains[2])) {
+        ESP_LOGI(p_tag,"Auto-tune PID gains kp %f ki %f kd %f",gains[0],gains[1],gains[2]);
+        pid_set_gains(&heater.pid,gains[0],gains[1],gains[2]);
+        (void)autotune_gains_store(gains[0],gains[1],gains[2]);
+        app_main_send_gains();
+    } else {
+        ESP_LOGW(p_tag,"Auto-tune failed: keeping previous PID gains");
+    }
+    app_main_send_autotune();
+
+    heater_set_mode(HEATER_MODE_PID);
+}
+
+//-----------------------------------------------------------------------------
+// Action a single received opcode tuple
+
+static void app_main_opcode(uint32_t opcode,const uint8_t *p_data,uint8_t dlen)
+{
+    switch (opcode) {
+        case OPCODE_HEATER_MODE:
+            if ((1 == dlen) && (HEATER_MODE_CASCADE == p_data[0]) && lockin_active()) {
+                // the inner loop would read the channel being modulated
+                ESP_LOGW(p_tag,"Cascade mode refused during a lock-in measurement");
+            } else if ((1 == dlen) && (p_data[0] <= HEATER_MODE_CASCADE)) {
+                heater_set_mode((heater_mode_t)p_data[0]);
+            } else {
+                ESP_LOGW(p_tag,"Invalid heater mode");
+            }
+            break;
+        case OPCODE_PID_GAINS:
+            if ((3 * sizeof(float)) == dlen) {
+                float gains[3];
+
+                (void)memcpy(gains,p_data,sizeof(gains));
+                if (isfinite(gains[0]) && isfinite(gains[1]) && isfinite(gains[2]) && (gains[0] >= 0) && (gains[1] >= 0) && (gains[2] >= 0)) {
+                    pid_set_gains(&heater.pid,gains[0],gains[1],gains[2]);
+                    ESP_LOGI(p_tag,"PID gains kp %f ki %f kd %f",gains[0],gains[1],gains[2]);
+                    // kept across a reboot, as auto-tuned gains are
+                    (void)autotune_gains_store(gains[0],gains[1],gains[2]);
+                } else {
+                    ESP_LOGW(p_tag,"Rejected PID gains kp %f ki %f kd %f",gains[0],gains[1],gains[2]);
+                }
+            } else {
+                ESP_LOGW(p_tag,"Invalid PID gains");
+            }
+            // the reply carries the gains in effect, unchanged if rejected
+            app_main_send_gains();
+            break;
+        case OPCODE_AUTOTUNE:
+            heater_set_mode(HEATER_MODE_AUTOTUNE);
+            break;
+        case OPCODE_AMBIENT_PROBE:
+            if ((1 + sizeof(uint64_t)) == dlen) {
+                probe_addr_t probe;
+                uint64_t rom;
+                esp_err_t ret;
+
+                (void)memcpy(&rom,&p_data[1],sizeof(rom));
+                probe.bus = (gpio_num_t)p_data[0];
+                probe.rom = rom;
+                ret = probes_set_ambient(&probe);
+                if ((ESP_ERR_INVALID_ARG == ret) || (ESP_ERR_NOT_FOUND == ret)) {
+                    ESP_LOGW(p_tag,"Rejected ambient probe %u:0x%llx (%s)",p_data[0],rom,esp_err_to_name(ret));
+                }
+            } else if (0 == dlen) {
+                (void)probes_set_ambient(NULL);
+                ambient = 0;
+            } else {
+                ESP_LOGW(p_tag,"Invalid ambient probe");
+            }
+            // the reply carries the probe in effect, unchanged if rejected
+            app_main_send_ambient();
+            break;
+        case OPCODE_PROFILE:
+            (void)profile_load(p_data,dlen);
+            app_main_send_profile();
+            break;
+        case OPCODE_PROFILE_RUN:
+            if ((1 == dlen) && p_data[0]) {
+                if (ESP_OK != profile_start(heater.setpoint)) {
+                    ESP_LOGW(p_tag,"No temperature profile loaded");
+                }
+            } else if (1 == dlen) {
+                profile_stop();
+            } else {
+                ESP_LOGW(p_tag,"Invalid profile run request");
+            }
+            app_main_send_profile();
+            break;
+        case OPCODE_LOCKIN:
+            {
+                uint16_t request[2] = { LOCKIN_FREQUENCY_DEFAULT, LOCKIN_CYCLES_DEFAULT };
+
+                if (sizeof(request) == dlen) {
+                    (void)memcpy(request,p_data,sizeof(request));
+                } else if (0 != dlen) {
+                    ESP_LOGW(p_tag,"Invalid lock-in request");
+                    break;
+                }
+                if (HEATER_MODE_CASCADE == heater.mode) {
+                    // the cascade inner loop regulates on the IN1 channel
+                    ESP_LOGW(p_tag,"Lock-in measurement refused in cascade mode");
+                    break;
+                }
+                if (ESP_OK != lockin_start(request[0],request[1])) {
+                    ESP_LOGW(p_tag,"Lock-in measurement not started");
+                }
+            }
+            break;
+        default:
+            // all other codes are currently undefined and IGNORED
+            break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Force the heater off while any probe is over the alarm threshold
+
+static bool heater_alarm(void)
+{
+    if (!probes_alarm())
+        return false;
+
+    cascade_stop();
+    if (heater.duty) {
+        ESP_LOGE(p_tag,"Probe over-temperature alarm");
+        // cut the heater at once rather than wait for a quiet window
+        heater_set(0);
+        probes_discard();
+        HEATER_OFF();
+        heater.state = COOLING;
+    }
+    // resume from zero duty once the alarm clears
+    pid_reset(&heater.pid, heater.setpoint, heater.temperature, 0);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Control period elapsed: wake the control task
+
+static void control_timer_callback(void *p_arg)
+{
+    portENTER_CRITICAL(&control_mux);
+    control_due_us += ((int64_t)LOOP_FREQUENCY * 1000);
+    portEXIT_CRITICAL(&control_mux);
+
+    if (pdTRUE != xSemaphoreGive(control_tick))
+        control_stats.overruns++;
+}
+
+// New probe readings published, or an alarm sweep changed the alarm state:
+// wake the control task
+
+static void control_probes_ready(void)
+{
+    (void)xSemaphoreGive(control_ready);
 }
 
 //-----------------------------------------------------------------------------
@@ -171,27 +617,138 @@ static float get_temperature(void) {
    the BluFi interaction (and any other processing we want common to the
    different control loops). */
 
-#define LOOP_FREQUENCY  (1000)
-
 static void app_main_control(void)
 {
-    event_appdata_t appdata;
-    const TickType_t xFrequency = (LOOP_FREQUENCY / portTICK_PERIOD_MS);
-    const float time_scale = 1000 / LOOP_FREQUENCY;  // scale to seconds
+    profile_fan_t profile_fan = PROFILE_FAN_AUTO;
+    int64_t now = esp_timer_get_time();
+    float temperature;
+    float elapsed;  // seconds since the previous valid reading
 
-   /* TODO: If we want the temperature control to be synchronised at some
-       frequency we should do it off of a timer worker or similar rather
-       than a vTaskDelay() in this loop; since we may want higher frequency
-       polling of other subsystems (e.g. BluFi events) by this control loop. */
+    // report a completed optical measurement
+    {
+        lockin_result_t result;
+
+        if (lockin_get_result(&result)) {
+            float report[6];
+
+            report[0] = result.amplitude[0];
+            report[1] = result.amplitude[1];
+            report[2] = result.ambient[0];
+            report[3] = result.ambient[1];
+            report[4] = result.drift[0];
+            report[5] = result.drift[1];
+            app_main_send(OPCODE_LOCKIN,report,sizeof(report));
+        }
+    }
+
+    /* Without a valid reading there is nothing to regulate on: hold the last
+       good temperature and the outputs, and keep the controllers, the model
+       and any profile as they are. Persistent failures turn the heater off. */
+    if (!get_temperature(&temperature)) {
+        if (FAILED_READINGS_MAX == ++failed_readings) {
+            ESP_LOGE(p_tag,"No valid probe reading for %u cycles: heater off",failed_readings);
+            cascade_stop();
+            heater_request(0);
+            heater.duty = 0;
+            if (IDLE != heater.state)
+                heater.state = COOLING;
+        }
+        (void)heater_alarm();
+        return;
+    }
+    if (failed_readings >= FAILED_READINGS_MAX) {
+        // regulation resumes from the heater off
+        ESP_LOGI(p_tag,"Probe readings restored");
+        pid_reset(&heater.pid, heater.setpoint, temperature, 0);
+        last_temperature = temperature;
+        // the heater was off, so none of that time counts towards a profile
+        last_temperature_us = now;
+    }
+    failed_readings = 0;
+
+    elapsed = ((now - last_temperature_us) / 1000000.0f);
+    heater.temperature = temperature;
+    heater.gradient = ((elapsed > 0) ? ((heater.temperature - last_temperature) / elapsed) : 0); // in degrees/second
+    last_temperature = heater.temperature;
+    last_temperature_us = now;
+
+    // a running temperature profile owns the setpoint
+    {
+        profile_status_t before, after;
+        float setpoint;
+
+        profile_get_status(&before);
+        if (profile_tick(heater.temperature, elapsed, &setpoint, &profile_fan)) {
+            heater_set_setpoint(setpoint);
+        }
+        profile_get_status(&after);
+        if ((before.phase != after.phase) || (before.step != after.step)) {
+            app_main_send_profile();
+        }
+    }
 
-    // Wait for the next cycle.
-    vTaskDelayUntil(&xLastWakeTime, xFrequency);
+    /* Coarse conversions are 4x quicker, so use them while the block is far
+       from the setpoint and only pay for full resolution when regulating. */
+    if (fabsf(heater.temperature - heater.setpoint) > heater.adjustment)
+        probes_set_resolution(DS18B20_RESOLUTION_10_BIT);
+    else
+        probes_set_resolution(DS18B20_RESOLUTION_12_BIT);
 
-    heater.temperature = get_temperature();
-    heater.gradient = (last_temperature - heater.temperature) * time_scale; // in degrees/second
     printf("[%d] mode: %s temperature: %0.1f (%0.1f)\n", xTaskGetTickCount(), STATE2STR(heater.state), heater.temperature, heater.gradient);
 
-    switch (heater.state) {
+    // a probe over the alarm threshold overrides the regulation below
+    if (heater_alarm()) {
+        // regulation resumes once the alarm clears
+    } else if (HEATER_MODE_AUTOTUNE == heater.mode) {
+        unsigned int progress = autotune_progress(&heater.autotune);
+        int duty = (int)autotune_update(&heater.autotune, heater.temperature, esp_timer_get_time());
+
+        if (duty != heater.duty) {
+            heater_request(duty);
+            heater.duty = duty;
+        }
+        heater.state = (duty ? HEATING : COOLING);
+
+        if (AUTOTUNE_RUNNING != heater.autotune.state) {
+            heater_autotune_finish();
+        } else if (progress != autotune_progress(&heater.autotune)) {
+            app_main_send_autotune();
+        }
+    } else if ((HEATER_MODE_CASCADE == heater.mode) && (IDLE != heater.state)) {
+        float inner = (heater.setpoint + pid_update(&cascade_outer, heater.setpoint, heater.temperature, elapsed));
+        cascade_status_t status;
+
+        // (re)starts after an alarm; otherwise only the setpoint changes
+        cascade_start(inner, heater.duty);
+        cascade_set_setpoint(inner);
+
+        cascade_get_status(&status);
+        heater.duty = status.duty;
+        heater.state = (status.duty ? HEATING : COOLING);
+        heater.fan = (((0 == status.duty) && (heater.temperature > (heater.setpoint + heater.histeresis))) ? LEDC_MAX_DUTY : 0);
+        fan_request(heater.fan);
+    } else if ((HEATER_MODE_MPC == heater.mode) && (IDLE != heater.state) && heater_model_ready()) {
+        float u, fan;
+
+        mpc_solve(&mpc, &thermal, (heater.temperature - ambient), (heater.setpoint - ambient), &u, &fan);
+        heater_request(u * LEDC_MAX_DUTY);
+        heater.duty = (int)((u * LEDC_MAX_DUTY) + 0.5f);
+        heater.state = (heater.duty ? HEATING : COOLING);
+        heater.fan = (int)(fan * LEDC_MAX_DUTY);
+        fan_request(heater.fan);
+
+        // keep the fallback controller ready to take over bumplessly
+        pid_reset(&heater.pid, heater.setpoint, heater.temperature, (heater.duty ? heater.duty : -heater.fan));
+    } else if (((HEATER_MODE_PID == heater.mode) || (HEATER_MODE_MPC == heater.mode)) && (IDLE != heater.state)) {
+        // MPC also runs the PID controller until the model is ready
+        float demand = pid_update(&heater.pid, heater.setpoint, heater.temperature, elapsed);
+
+        /* The controller output spans heating (positive) and cooling
+           (negative), so the fan comes in proportionally once the heater is
+           off. */
+        heater_actuate(demand, &heater.duty, &heater.fan);
+        heater.state = (heater.duty ? HEATING : COOLING);
+    } else switch (heater.state) {
         case IDLE:
             // the device heater is idle: do nothing
             break;
@@ -213,6 +770,40 @@ static void app_main_control(void)
             break; 
     }
 
+    // the profile step fan policy overrides the controller (bar auto-tune)
+    if ((PROFILE_FAN_AUTO != profile_fan) && (HEATER_MODE_AUTOTUNE != heater.mode)) {
+        heater.fan = ((PROFILE_FAN_ON == profile_fan) ? LEDC_MAX_DUTY : 0);
+        fan_request(heater.fan);
+    }
+
+    // fit the thermal model with the outputs now applied, over the measured interval
+    thermal_update(&thermal, (heater.temperature - ambient), ((float)heater.duty / LEDC_MAX_DUTY), ((float)heater.fan / LEDC_MAX_DUTY), elapsed);
+    if (0 == (thermal.updates % THERMAL_REPORT_CYCLES)) {
+        thermal_params_t params;
+
+        if (thermal_get_params(&thermal,&params)) {
+            ESP_LOGI(p_tag,"Thermal model tau %.0f s gain %.1f degC fan %.1f degC offset %.1f degC (residual %.3f)",params.tau,params.gain,params.fan_gain,params.offset,thermal.residual);
+            if (mpc.solves) {
+                ESP_LOGI(p_tag,"MPC solve %u us (worst %u us over %u)",mpc.last_us,mpc.worst_us,mpc.solves);
+            }
+            if (HEATER_MODE_CASCADE == heater.mode) {
+                cascade_status_t status;
+                cascade_get_status(&status);
+                ESP_LOGI(p_tag,"Cascade inner %.2f degC setpoint %.2f degC (%u samples, %u errors, %u overruns)",status.measurement,status.setpoint,status.samples,status.errors,status.overruns);
+            }
+            app_main_send(OPCODE_THERMAL_MODEL,&params,sizeof(params));
+        }
+    }
+
+    return;
+}
+
+//-----------------------------------------------------------------------------
+// Parse one received appdata blob (the control task is woken for each)
+
+static void app_main_appdata(void)
+{
+    event_appdata_t appdata;
 
     // Do not block waiting for data:
     if (xQueueReceive(queue_appdata,&appdata,0)) {
@@ -268,7 +859,7 @@ static void app_main_control(void)
                             esp_log_buffer_hex(" OpcodeData",p_tuple,tlen);
                         }
 
-                        /* IMPLEMENT: Whatever actions are needed for the opcode value */
+                        app_main_opcode(opcode,p_tuple,tlen);
 
                         /* e.g. trigger a set (i.e. multiple items if needed) of
                           individually "code"-identified data via:
@@ -292,6 +883,98 @@ static void app_main_control(void)
     return;
 }
 
+//-----------------------------------------------------------------------------
+/* Wait for the next event. A control cycle is run for every timer period;
+   periods that elapse while one is still pending are counted as overruns and
+   not made up, so the next cycle simply runs with the latest readings. */
+
+static void control_worker(void *p_arg)
+{
+    for (;;) {
+        QueueSetMemberHandle_t event = xQueueSelectFromSet(control_events, portMAX_DELAY);
+        int64_t now_us, due_us;
+        int32_t jitter;
+
+        if (event == queue_appdata) {
+            app_main_appdata();
+            continue;
+        }
+        if (event == control_ready) {
+            (void)xSemaphoreTake(control_ready, 0);
+            (void)heater_alarm();
+            continue;
+        }
+        if ((event != control_tick) || (pdTRUE != xSemaphoreTake(control_tick, 0)))
+            continue;
+
+        now_us = esp_timer_get_time();
+        portENTER_CRITICAL(&control_mux);
+        due_us = control_due_us;
+        portEXIT_CRITICAL(&control_mux);
+        jitter = (int32_t)(now_us - due_us);
+        control_stats.jitter_us = jitter;
+        if (abs(jitter) > control_stats.jitter_max_us)
+            control_stats.jitter_max_us = abs(jitter);
+
+        app_main_control();
+
+        control_stats.run_us = (uint32_t)(esp_timer_get_time() - now_us);
+        if (control_stats.run_us > control_stats.run_max_us)
+            control_stats.run_max_us = control_stats.run_us;
+        if (0 == (++control_stats.cycles % CONTROL_REPORT_CYCLES)) {
+            ESP_LOGI(p_tag,"Control %u cycles, %u overruns, jitter %d us (worst %d us), run %u us (worst %u us)",control_stats.cycles,control_stats.overruns,control_stats.jitter_us,control_stats.jitter_max_us,control_stats.run_us,control_stats.run_max_us);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+/* The event sources must be added to the set while they are empty, so this
+   is done as soon as the appdata queue exists. */
+
+static esp_err_t control_init(void)
+{
+    control_events = xQueueCreateSet(QUEUE_DEPTH_APPDATA + 2);
+    control_tick = xSemaphoreCreateBinary();
+    control_ready = xSemaphoreCreateBinary();
+    if ((NULL == control_events) || (NULL == control_tick) || (NULL == control_ready) || (NULL == queue_appdata))
+        return ESP_ERR_NO_MEM;
+
+    if ((pdPASS != xQueueAddToSet(queue_appdata, control_events)) || (pdPASS != xQueueAddToSet(control_tick, control_events)) || (pdPASS != xQueueAddToSet(control_ready, control_events)))
+        return ESP_ERR_INVALID_STATE;
+
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+static esp_err_t control_start(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = control_timer_callback,
+        .name = "control"
+    };
+    esp_err_t ret;
+
+    if (pdPASS != xTaskCreatePinnedToCore(control_worker, "control", CONTROL_TASK_STACK, NULL, CONTROL_TASK_PRIORITY, &control_task, CONTROL_TASK_CORE)) {
+        ESP_LOGE(p_tag,"Failed to create control task");
+        return ESP_ERR_NO_MEM;
+    }
+    probes_set_ready_hook(control_probes_ready);
+    probes_set_alarm_hook(control_probes_ready);
+
+    ret = esp_timer_create(&timer_args, &control_timer);
+    if (ESP_OK == ret) {
+        // the task is blocked until the first period elapses
+        control_due_us = esp_timer_get_time();
+        ret = esp_timer_start_periodic(control_timer, ((uint64_t)LOOP_FREQUENCY * 1000));
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGE(p_tag,"Failed to start control timer (%s)",esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
 //-----------------------------------------------------------------------------
 
 void app_main(void)
@@ -373,6 +1056,9 @@ void app_main(void)
     if (NULL == queue_appdata) {
         ESP_LOGE(p_tag,"Failed to create main appdata queue");
     }
+    if (ESP_OK != control_init()) {
+        ESP_LOGE(p_tag,"Failed to create control event set");
+    }
 
     app_common_platform_init();
 #if defined(CONFIG_MLAB_HTTPD) && CONFIG_MLAB_HTTPD
@@ -398,9 +1084,26 @@ void app_main(void)
 
     spi_device_handle_t opamp_adc = app_init_spi();
     ESP_LOGI(p_tag,"opamp_adc %p",opamp_adc);
+
+    // the cascade inner loop stays idle until HEATER_MODE_CASCADE is selected
+    if (ESP_OK == cascade_init(opamp_adc, CASCADE_ADC_CHANNEL, CASCADE_ADC_SCALE, CASCADE_ADC_OFFSET)) {
+        cascade_set_gains(CASCADE_INNER_KP, CASCADE_INNER_KI, CASCADE_INNER_KD);
+    } else {
+        ESP_LOGE(p_tag,"Failed to start cascade inner loop");
+    }
+
+#if defined(CONFIG_MLAB_ADC_PWM_SYNC) && CONFIG_MLAB_ADC_PWM_SYNC
+    // keep the conversions clear of the heater and fan switching edges
+    adc122s021_set_quiet_hook(heater_quiet_delay, HEATER_PWM_PERIOD_US);
+#endif // CONFIG_MLAB_ADC_PWM_SYNC
+
+    // UV LED lock-in measurements run on request
+    if (ESP_OK != lockin_init(opamp_adc)) {
+        ESP_LOGE(p_tag,"Failed to initialise lock-in detection");
+    }
  
     // initialize GPIO output pins -- onewire is setup by its own library
-    #define GPIO_OUTPUT_PIN_SEL  ((1ULL<<FAN_CTRL) | (1ULL<<CONTROL_3V3) | (1ULL<<GREEN_LED) | (1ULL<<YELLOW_LED) | (1ULL<<RED_LED) | (1ULL<<UV1_LED) | (1ULL<<UV2_LED) )
+    #define GPIO_OUTPUT_PIN_SEL  ((1ULL<<CONTROL_3V3) | (1ULL<<GREEN_LED) | (1ULL<<YELLOW_LED) | (1ULL<<RED_LED) | (1ULL<<UV1_LED) | (1ULL<<UV2_LED) )
 
     gpio_config_t io_conf;
     //disable interrupt
@@ -434,36 +1137,18 @@ void app_main(void)
     else
         printf("1Wire reset. No detected devices.\n");
 
-    int count = 0;
-    // 1wire search
-    onewire_search_start(&onewire_ds);
-    do {
-        onewire_addr_t device_addr;
-
-        device_addr = onewire_search_next(&onewire_ds, ONEWIRE_PIN);
-        if (device_addr != ONEWIRE_NONE) {
-            sensors[count++] = device_addr;
-            printf ("\t0x%llx\n", device_addr);
-        } else {
-            static volatile TickType_t ticklast = 0;
-            volatile TickType_t ticknow = xTaskGetTickCount();
-            if ((ticknow - ticklast) >= 1000) {
-                printf("Error searching the 1wire bus.\n");
-                ticklast = ticknow;
-                break;
-            } else {
-                vTaskDelay(10); // avoids the watchdog triggering // which we still get with a simple taskYIELD() call
-            }
-        }
-
-        // app_main_control();
-
-    } while(!onewire_ds.last_device_found && (count <= MAX_SENSORS));
-    printf("1Wire search: found %d devices.\n", count);
+    // 1wire search (or verified ROM table from the last boot)
+    unsigned int count = probes_init();
+    printf("1Wire search: found %u devices.\n", count);
 
     // initialize the DS18B20 library
     ds18b20_init();
 
+    // start the background probe acquisition at the control loop rate
+    if (ESP_OK != probes_start(LOOP_FREQUENCY)) {
+        ESP_LOGE(p_tag,"Failed to start probe acquisition");
+    }
+
     // turn on green LED
     gpio_set_direction(GREEN_LED, GPIO_MODE_OUTPUT);
     gpio_set_level(GREEN_LED, 1);
@@ -484,20 +1169,66 @@ void app_main(void)
     gpio_set_direction(UV2_LED, GPIO_MODE_OUTPUT);
     gpio_set_level(UV2_LED, 1);
 
-    // Initialise global xLastWakeTime variable with the current time.
-    xLastWakeTime = xTaskGetTickCount ();
+    /* Wait for the first complete set of probe readings. If no probe ever
+       answers, start anyway so the client can still connect: the heater is
+       left off until a valid reading arrives. */
+    {
+        probes_reading_t reading;
+        const TickType_t start = xTaskGetTickCount();
+
+        while (!probes_get_latest(&reading)) {
+            if ((xTaskGetTickCount() - start) >= pdMS_TO_TICKS(STARTUP_PROBES_TIMEOUT_MS)) {
+                ESP_LOGE(p_tag,"No probe readings after %u ms: starting with the heater off",STARTUP_PROBES_TIMEOUT_MS);
+                break;
+            }
+            vTaskDelay(10);
+        }
+    }
 
     // Initial heater state
     heater.state = IDLE;
-    heater.temperature = get_temperature();
+    heater.temperature = 0.;
+    bool valid_temperature = get_temperature(&heater.temperature);
     heater.setpoint = 74.0;
     heater.histeresis = 0.5;
     heater.adjustment = 5.0;
+    heater.mode = HEATER_MODE_HYSTERESIS;
+    pid_init(&heater.pid, PID_KP, PID_KI, PID_KD, -LEDC_MAX_DUTY, LEDC_MAX_DUTY);
+    heater_mode_t boot_mode = HEATER_MODE_DEFAULT;
+    {
+        float gains[3];
+        if (ESP_OK == autotune_gains_load(&gains[0],&gains[1],&gains[2])) {
+            ESP_LOGI(p_tag,"Using auto-tuned PID gains kp %f ki %f kd %f",gains[0],gains[1],gains[2]);
+            pid_set_gains(&heater.pid,gains[0],gains[1],gains[2]);
+            // the built-in gains are not tuned for any block, so only then
+            boot_mode = HEATER_MODE_PID;
+        }
+    }
+
+    // cheap out-of-band check between full readings
+    alarm_high = heater_alarm_high(heater.setpoint);
+    probes_set_alarm(alarm_high, DS18B20_TEMP_MIN);
+
+    // continue any temperature profile interrupted by a reboot
+    if (profile_restore()) {
+        profile_status_t status;
+
+        profile_get_status(&status);
+        heater_set_setpoint(status.setpoint);
+    }
 
     last_temperature = heater.temperature;
+    last_temperature_us = esp_timer_get_time();
+    thermal_init(&thermal, (LOOP_FREQUENCY / 1000.0), THERMAL_DELAY, THERMAL_LAMBDA);
+    mpc_init(&mpc, MPC_SWITCH_WEIGHT, MPC_ENERGY_WEIGHT);
+    pid_init(&cascade_outer, CASCADE_OUTER_KP, CASCADE_OUTER_KI, 0, -CASCADE_TRIM, CASCADE_TRIM);
 
     // to kick the action at startup -- eventually triggered by user events
-    if (heater.temperature < (heater.setpoint - heater.adjustment)) {
+    if (!valid_temperature) {
+        // the heater stays off until the control loop has a valid reading
+        failed_readings = FAILED_READINGS_MAX;
+        heater.state = COOLING;
+    } else if (heater.temperature < (heater.setpoint - heater.adjustment)) {
         // switch to heating mode
         HEATER_ON();
         heater.state = HEATING;
@@ -506,51 +1237,11 @@ void app_main(void)
         HEATER_OFF();
         heater.state = COOLING;
     }
+    heater_set_mode(boot_mode);
 
-    while (1) {
-  
-#if 0
-        // heater on
-        int hcount = 0;
-        heater_set(LEDC_MAX_DUTY);
-        printf("[%d] Heater ON ---------\n", xTaskGetTickCount ());
-        vTaskDelay(250 / portTICK_RATE_MS);
-
-        // fan off
-        gpio_set_direction(FAN_CTRL, GPIO_MODE_OUTPUT);
-        gpio_set_level(FAN_CTRL, 0);
-
-        // stabilize 1wire after heater or fan switch
-        ds18b20_get_temp(sensors[0]);ds18b20_get_temp(sensors[1]);ds18b20_get_temp(sensors[2]);
-     
-
-        /* Simple "slightly busy" loop where we sleep to allow the IDLE task to
-           execute so that it can tickle its watchdog. */
-        printf("Temperature[0x%llx]: %0.1f °C\n", sensors[0], ds18b20_get_temp(sensors[0]));
-        printf("Temperature[0x%llx]: %0.1f °C\n", sensors[1], ds18b20_get_temp(sensors[1]));
-        printf("Temperature[0x%llx]: %0.1f °C\n", sensors[2], ds18b20_get_temp(sensors[2]));
-
-        uint32_t in1;
-        uint32_t in2;
-        esp_err_t err = adc122s021_read(opamp_adc,&in1,&in2);
-        if (ESP_OK == err) {
-            ESP_LOGI(p_tag,"IN1 0x%08X IN2 0x%08X",in1,in2);
-        }
-        
-        // heat for 30 seconds
-        if (hcount++ == 30) {
-            heater_set(0);
-            printf("[%d] Heater OFF ---------\n", xTaskGetTickCount ());
-
-            // fan on
-            gpio_set_level(FAN_CTRL, 1);
-
-            // stabilize 1wire
-            ds18b20_get_temp(sensors[0]);ds18b20_get_temp(sensors[1]);ds18b20_get_temp(sensors[2]);
-    //           onewire_reset(ONEWIRE_PIN);
-        }
-#endif
-        app_main_control();
+    // from here on the heater is only driven by the control task
+    if (ESP_OK == control_start()) {
+        return;
     }
 
     // This point should not be reached normally:
@@ -13,6 +13,11 @@
 
 #define MLAB_MODEL	"100"
 
+//-----------------------------------------------------------------------------
+
+#include "pid.h"
+#include "autotune.h"
+
 //-----------------------------------------------------------------------------
 // Useful (standard) helper macros:
 
@@ -49,6 +54,10 @@
 // 1wire bus
 #define ONEWIRE_PIN (15)
 
+// Independent 1wire buses, one GPIO each. Probes on different buses are
+// converted and read in parallel, so extra groups do not lengthen a cycle.
+#define ONEWIRE_BUS_PINS { ONEWIRE_PIN }
+
 // control 3.3V regulator
 #define CONTROL_3V3   (14)
 
@@ -64,7 +73,7 @@
 // heater PWM pin
 #define HEATER_CTRL		(32)
 
-// fan GPIP
+// fan PWM pin
 #define FAN_CTRL	(17)
 
 //-----------------------------------------------------------------------------
@@ -76,21 +85,39 @@ typedef enum {
     HEATING
 }   heater_states_t;
 
+// Heater control algorithm
+typedef enum {
+    HEATER_MODE_HYSTERESIS,     // on/off switching around the setpoint
+    HEATER_MODE_PID,            // proportional duty from the PID controller
+    HEATER_MODE_AUTOTUNE,       // relay experiment to derive the PID gains
+    HEATER_MODE_MPC,            // model-predictive duty and fan from the thermal model
+    HEATER_MODE_CASCADE         // probes trim the setpoint of a fast analog inner loop
+}   heater_mode_t;
+
+#define HEATER_MODE_DEFAULT HEATER_MODE_HYSTERESIS // PID once tuned gains have been stored
+
 // Device heating control
 typedef struct  {
 	heater_states_t state;
+	heater_mode_t mode;
 	float	temperature;
 	float	gradient;
 	float	setpoint;
 	float	histeresis;
 	float	adjustment;
+	int	duty;               // heater duty last applied (0..LEDC_MAX_DUTY)
+	int	fan;                // fan duty last applied (0..LEDC_MAX_DUTY)
+	pid_controller_t pid;   // used in HEATER_MODE_PID
+	autotune_t autotune;    // used in HEATER_MODE_AUTOTUNE
 } heater_t;
 
 // string representation of state
 #define STATE2STR(state) (state == IDLE ? "IDLE" : (state == HEATING ? "HEATING" : "COOLING"))
+#define MODE2STR(mode) (mode == HEATER_MODE_PID ? "PID" : (mode == HEATER_MODE_AUTOTUNE ? "AUTOTUNE" : (mode == HEATER_MODE_MPC ? "MPC" : (mode == HEATER_MODE_CASCADE ? "CASCADE" : "HYSTERESIS"))))
 
-#define HEATER_OFF() {printf("heater_off()\n");heater_set(0);gpio_set_level(FAN_CTRL, 1);ds18b20_get_temp(sensors[0]);ds18b20_get_temp(sensors[1]);ds18b20_get_temp(sensors[2]);}
-#define HEATER_ON() {printf("heater_on()\n");heater_set(1);gpio_set_level(FAN_CTRL, 0);ds18b20_get_temp(sensors[0]);ds18b20_get_temp(sensors[1]);ds18b20_get_temp(sensors[2]);}
+// switching is faded in the next 1-Wire quiet window, so no reading is disturbed
+#define HEATER_OFF() {printf("heater_off()\n");heater_request(0);heater.duty = 0;fan_request(LEDC_MAX_DUTY);heater.fan = LEDC_MAX_DUTY;}
+#define HEATER_ON() {printf("heater_on()\n");heater_request(LEDC_MAX_DUTY);heater.duty = LEDC_MAX_DUTY;fan_request(0);heater.fan = 0;}
 
 #endif // !__mlab100_h
 
@@ -0,0 +1,105 @@
+// mpc.c
+//=============================================================================
+/*
+ * Model-predictive heater control.
+ *
+ * The search space is deliberately small: a constant heater duty, held over
+ * the whole horizon (move blocking), from a coarse grid of MPC_DUTY_LEVELS
+ * plus MPC_FINE_LEVELS fine steps either side of the last duty, and a fan
+ * state from MPC_FAN_LEVELS. The fine steps let the duty settle between the
+ * coarse levels without a steady-state offset. Each candidate is rolled
+ * forward through the thermal model and scored on
+ *
+ *   sum over the horizon of (y - setpoint)^2
+ *     + switch_weight * (|u - u_last| + |fan - fan_last|)
+ *     + energy_weight * u * MPC_HORIZON
+ *
+ * and the cheapest is applied for one sample before solving again. This is
+ * at most MPC_CANDIDATES * MPC_FAN_LEVELS * MPC_HORIZON model steps, with no
+ * iteration; a candidate is dropped as soon as it costs more than the best
+ * so far, which only shortens the solve. The solve time is measured on every
+ * call, and test_mpc_host times the worst case on the build host.
+ */
+
+//=============================================================================
+
+#include <math.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "mpc.h"
+
+//-----------------------------------------------------------------------------
+
+#define MPC_FINE_STEP   (1.0f / ((MPC_DUTY_LEVELS - 1) * 16))
+#define MPC_CANDIDATES  (MPC_DUTY_LEVELS + (2 * MPC_FINE_LEVELS))
+
+//-----------------------------------------------------------------------------
+
+void mpc_init(mpc_t *p_mpc,float switch_weight,float energy_weight)
+{
+    memset(p_mpc, 0, sizeof(*p_mpc));
+    p_mpc->switch_weight = switch_weight;
+    p_mpc->energy_weight = energy_weight;
+}
+
+//-----------------------------------------------------------------------------
+
+void mpc_solve(mpc_t *p_mpc,const thermal_model_t *p_model,float y,float setpoint,float *p_u,float *p_fan)
+{
+    int64_t start = esp_timer_get_time();
+    float best_cost = INFINITY;
+    float best_u = 0;
+    float best_fan = 0;
+    float duties[MPC_CANDIDATES];
+    unsigned int d, f, j;
+    uint32_t elapsed;
+
+    for (d = 0; d < MPC_DUTY_LEVELS; d++)
+        duties[d] = ((float)d / (MPC_DUTY_LEVELS - 1));
+    for (j = 1; j <= MPC_FINE_LEVELS; j++) {
+        duties[d++] = fmaxf(0, (p_mpc->u - (j * MPC_FINE_STEP)));
+        duties[d++] = fminf(1, (p_mpc->u + (j * MPC_FINE_STEP)));
+    }
+
+    for (f = 0; f < MPC_FAN_LEVELS; f++) {
+        float fan = ((float)f / (MPC_FAN_LEVELS - 1));
+
+        for (d = 0; d < MPC_CANDIDATES; d++) {
+            float u = duties[d];
+            float cost = ((p_mpc->switch_weight * (fabsf(u - p_mpc->u) + fabsf(fan - p_mpc->fan))) + (p_mpc->energy_weight * u * MPC_HORIZON));
+            float yk = y;
+
+            for (j = 0; (j < MPC_HORIZON) && (cost < best_cost); j++) {
+                // the duty already in the dead time comes from the history
+                float u_delayed = ((j < p_model->delay) ? thermal_past_input(p_model, (p_model->delay - 1 - j)) : u);
+
+                yk = thermal_predict(p_model, yk, u_delayed, fan);
+                cost += ((yk - setpoint) * (yk - setpoint));
+            }
+
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_u = u;
+                best_fan = fan;
+            }
+        }
+    }
+
+    p_mpc->u = best_u;
+    p_mpc->fan = best_fan;
+    p_mpc->cost = best_cost;
+    p_mpc->solves++;
+
+    elapsed = (uint32_t)(esp_timer_get_time() - start);
+    p_mpc->last_us = elapsed;
+    if (elapsed > p_mpc->worst_us)
+        p_mpc->worst_us = elapsed;
+
+    *p_u = best_u;
+    *p_fan = best_fan;
+}
+
+//=============================================================================
+// EOF mpc.c
@@ -0,0 +1,76 @@
+// mpc.h
+//=============================================================================
+
+#if !defined(__mpc_h)
+#define __mpc_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+
+#include "thermal.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define MPC_HORIZON      (30) // prediction horizon in samples
+#define MPC_DUTY_LEVELS  (9)  // coarse candidate heater duties 0, 1/8 .. 1
+#define MPC_FINE_LEVELS  (2)  // fine candidate duties either side of the last one
+#define MPC_FAN_LEVELS   (2)  // candidate fan drives off, on
+
+// Predictive controller state
+typedef struct {
+    float switch_weight;    // cost per unit change of duty or fan
+    float energy_weight;    // cost per unit duty
+    float u;                // last chosen duty (0..1)
+    float fan;              // last chosen fan drive (0..1)
+    float cost;             // cost of the last choice
+    uint32_t solves;        // number of solves
+    uint32_t last_us;       // time taken by the last solve
+    uint32_t worst_us;      // longest solve seen
+} mpc_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise the controller.
+ *
+ * @param p_mpc Controller state.
+ * @param switch_weight Cost per unit change of heater duty or fan drive,
+ *        relative to one degree squared of tracking error per sample.
+ * @param energy_weight Cost per unit heater duty per sample.
+ */
+extern void mpc_init(mpc_t *p_mpc, float switch_weight, float energy_weight);
+
+/**
+ * Choose the heater duty and fan drive for this sample. Every combination of
+ * the candidate duties (MPC_DUTY_LEVELS coarse plus MPC_FINE_LEVELS either
+ * side of the last duty) and MPC_FAN_LEVELS fan drives, held over the
+ * horizon, is simulated with the thermal model (including the duty already
+ * in the dead time), so the solve time is fixed by the compile-time sizes.
+ *
+ * @param p_mpc Controller state.
+ * @param p_model Fitted thermal model, in the same temperature frame as y.
+ * @param y Current temperature.
+ * @param setpoint Target temperature.
+ * @param p_u Filled with the heater duty to apply (0..1).
+ * @param p_fan Filled with the fan drive to apply (0..1).
+ */
+extern void mpc_solve(mpc_t *p_mpc, const thermal_model_t *p_model, float y, float setpoint, float *p_u, float *p_fan);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__mpc_h
+
+//=============================================================================
+// EOF mpc.h
@@ -0,0 +1,87 @@
+// pid.c
+//=============================================================================
+/*
+ * PID controller with anti-windup, derivative on measurement and output
+ * clamping.
+ *
+ *   u = kp * e + I - kd * d(input)/dt        I += ki * e * dt
+ *
+ * The integral term is kept in output units so that gain changes and mode
+ * switches are bumpless.
+ */
+
+//=============================================================================
+
+#include <string.h>
+
+#include "pid.h"
+
+//-----------------------------------------------------------------------------
+
+static float pid_clamp(float value,float min,float max)
+{
+    if (value < min)
+        return min;
+    if (value > max)
+        return max;
+    return value;
+}
+
+//-----------------------------------------------------------------------------
+
+void pid_init(pid_controller_t *p_pid,float kp,float ki,float kd,float out_min,float out_max)
+{
+    memset(p_pid, 0, sizeof(*p_pid));
+    p_pid->kp = kp;
+    p_pid->ki = ki;
+    p_pid->kd = kd;
+    p_pid->out_min = out_min;
+    p_pid->out_max = out_max;
+}
+
+//-----------------------------------------------------------------------------
+
+void pid_set_gains(pid_controller_t *p_pid,float kp,float ki,float kd)
+{
+    p_pid->kp = kp;
+    p_pid->ki = ki;
+    p_pid->kd = kd;
+}
+
+//-----------------------------------------------------------------------------
+
+void pid_reset(pid_controller_t *p_pid,float setpoint,float input,float output)
+{
+    // the proportional term takes its share of the output on the first step
+    p_pid->integral = pid_clamp((output - (p_pid->kp * (setpoint - input))), p_pid->out_min, p_pid->out_max);
+    p_pid->last_input = input;
+    p_pid->primed = true;
+}
+
+//-----------------------------------------------------------------------------
+
+float pid_update(pid_controller_t *p_pid,float setpoint,float input,float dt)
+{
+    float error = (setpoint - input);
+    float derivative = 0.;
+    float output;
+
+    if (p_pid->primed && (dt > 0.))
+        derivative = ((input - p_pid->last_input) / dt);
+    p_pid->last_input = input;
+    p_pid->primed = true;
+
+    output = ((p_pid->kp * error) + p_pid->integral - (p_pid->kd * derivative));
+
+    // only integrate when it would not push a saturated output further
+    if (!((output >= p_pid->out_max) && (error > 0.)) && !((output <= p_pid->out_min) && (error < 0.))) {
+        p_pid->integral += (p_pid->ki * error * dt);
+        p_pid->integral = pid_clamp(p_pid->integral, p_pid->out_min, p_pid->out_max);
+        output = ((p_pid->kp * error) + p_pid->integral - (p_pid->kd * derivative));
+    }
+
+    return pid_clamp(output, p_pid->out_min, p_pid->out_max);
+}
+
+//=============================================================================
+// EOF pid.c
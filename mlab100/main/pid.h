@@ -0,0 +1,88 @@
+// pid.h
+//=============================================================================
+
+#if !defined(__pid_h)
+#define __pid_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <stdbool.h>
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+// PID controller state. The gains are in output units per degree (and per
+// degree-second / degree-per-second for the integral and derivative terms).
+typedef struct {
+    float kp;               // proportional gain
+    float ki;               // integral gain
+    float kd;               // derivative gain
+    float out_min;          // output clamp
+    float out_max;
+    float integral;         // accumulated integral term, in output units
+    float last_input;       // previous measurement, for the derivative
+    bool primed;            // last_input is valid
+} pid_controller_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise a controller with the given gains and output range.
+ *
+ * @param p_pid Controller to initialise.
+ * @param kp Proportional gain.
+ * @param ki Integral gain.
+ * @param kd Derivative gain.
+ * @param out_min Lowest output value.
+ * @param out_max Highest output value.
+ */
+extern void pid_init(pid_controller_t *p_pid, float kp, float ki, float kd, float out_min, float out_max);
+
+/**
+ * Change the gains of a running controller. The integral term is held in
+ * output units, so the output does not jump when ki changes.
+ */
+extern void pid_set_gains(pid_controller_t *p_pid, float kp, float ki, float kd);
+
+/**
+ * Reset the controller for a bumpless start from the given operating point,
+ * e.g. when switching from another control mode. The integral term is
+ * preloaded so that the first step reproduces the applied output.
+ *
+ * @param p_pid Controller to reset.
+ * @param setpoint Setpoint the controller will run to.
+ * @param input Current measurement.
+ * @param output Output currently applied.
+ */
+extern void pid_reset(pid_controller_t *p_pid, float setpoint, float input, float output);
+
+/**
+ * Run one controller step. The derivative acts on the measurement rather than
+ * the error, so setpoint changes do not kick the output. The integral term is
+ * clamped to the output range and does not integrate further while the
+ * output is saturated in the direction of the error (anti-windup).
+ *
+ * @param p_pid Controller.
+ * @param setpoint Desired value.
+ * @param input Current measurement.
+ * @param dt Time since the previous step in seconds.
+ * @return output clamped to [out_min, out_max].
+ */
+extern float pid_update(pid_controller_t *p_pid, float setpoint, float input, float dt);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__pid_h
+
+//=============================================================================
+// EOF pid.h
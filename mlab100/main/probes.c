@@ -0,0 +1,918 @@
+// probes.c
+//=============================================================================
+/*
+ * DS18B20 probe acquisition engine.
+ *
+ * Each 1-Wire bus has its own task. On every cycle the coordinating task
+ * wakes all the bus tasks together; each issues a bus-wide Convert T and then
+ * sleeps until its esp_timer signals that the conversion time has elapsed,
+ * reads its scratchpads and reports back. The buses are independent, so a
+ * cycle takes as long as the slowest bus rather than the sum of them. The
+ * results are then published as one set with a timestamp. Consumers only
+ * ever copy the latest published set, so they never block on the 1-Wire bus.
+ *
+ *   IDLE --(Convert T)--> CONVERTING --(all buses read)--> READY --(period)--> ...
+ *
+ * The set of live probes is a registry sized by what is actually on the
+ * buses, each entry carrying the bus it was found on. A low priority task
+ * periodically re-runs the search of each bus between conversions to add new
+ * probes and retire missing ones. Each published reading carries the
+ * addresses it was taken from, so consumers always see a consistent view of
+ * which probes are live.
+ *
+ * Once alarm thresholds have been set the full readings are checked against
+ * them, and the time left before the next cycle is filled with alarm sweeps:
+ * a Convert T on every bus followed by a single Alarm Search, which finds
+ * every probe outside the thresholds without reading a scratchpad. A sweep is
+ * only started if it fits before the next cycle is due, so with fast
+ * (low resolution) conversions the out of band check runs several times per
+ * cycle, and the alarm hook reports any change as soon as a sweep ends.
+ *
+ * Once every bus has issued its Convert T (or has nothing to convert) the
+ * buses stay silent until the conversions complete. The quiet hook is called
+ * at the start of that window, so actuator switching can be done while no
+ * 1-Wire slot is in progress instead of discarding a disturbed conversion.
+ * The ready hook is called as each set of readings is published, so a
+ * consumer can wait for fresh data instead of polling for it.
+ */
+
+//=============================================================================
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "freertos/semphr.h"
+
+#include "onewire.h"
+#include "ds18b20.h"
+#include "probes.h"
+#include "mlab100.h"
+
+//-----------------------------------------------------------------------------
+
+static const char *p_tag = "probes"; // for esp-idf logging
+
+#define PROBES_TASK_STACK     (2048)
+#define PROBES_TASK_PRIORITY  (5)
+
+#define PROBES_BUS_STACK      (2048)
+#define PROBES_BUS_PRIORITY   (PROBES_TASK_PRIORITY + 1)
+
+#define PROBES_RESCAN_STACK     (2048)
+#define PROBES_RESCAN_PRIORITY  (1)
+#define PROBES_RESCAN_MS        (30 * 1000)
+#define PROBES_RETIRE_MISSES    (2) // consecutive searches a probe may be absent from
+
+#define PROBES_SEARCH_TIMEOUT_MS (1000) // give up on an empty or broken bus
+
+#define DS18B20_FAMILY        (0x28)
+
+// NVS cache of the probe table from the last full search
+#define PROBES_NVS_NAMESPACE  "probes"
+#define PROBES_NVS_KEY_ROMS   "roms_bus" // probe_addr_t[], superseding the single bus "roms"
+#define PROBES_NVS_KEY_AMBIENT "ambient" // probe_addr_t
+
+//-----------------------------------------------------------------------------
+
+static const gpio_num_t probes_bus_pins[] = ONEWIRE_BUS_PINS;
+#define PROBES_BUSES NUMOF(probes_bus_pins)
+
+/* Per-bus state. The lock is held for a whole conversion cycle or search, so
+   the only contention is between the bus task and the rescan of that bus. The
+   results are written by the bus task and read by the coordinator after the
+   bus task has reported back. */
+typedef struct {
+    gpio_num_t pin;
+    SemaphoreHandle_t lock;
+    TaskHandle_t task;
+    esp_timer_handle_t timer;
+    unsigned int resolution;    // resolution last applied to the probes on this bus
+    uint32_t alarm_generation;  // alarm thresholds last applied (0 if never)
+    volatile bool in_alarm;     // a probe was out of band at the latest check
+    uint32_t alarm;             // bit n set if addrs[n] was in alarm at the full read
+    bool converted;             // presence pulse seen for the last Convert T
+    bool swept;                 // the last alarm sweep ran
+    unsigned int count;
+    onewire_addr_t addrs[PROBES_MAX];
+    float temps[PROBES_MAX];
+    uint32_t valid;
+} probes_bus_t;
+
+static probes_bus_t probes_buses[PROBES_BUSES];
+
+/* The registry of live probes across all buses. It is guarded by
+   probes_registry_lock, and entries for a bus are only added or retired with
+   that bus's lock also held. */
+static SemaphoreHandle_t probes_registry_lock = NULL;
+static probe_addr_t probe_addrs[PROBES_MAX];
+static uint8_t probe_misses[PROBES_MAX];
+static unsigned int probe_count;
+static uint32_t probe_generation;
+
+static TaskHandle_t probes_task = NULL;
+static TaskHandle_t probes_rescan_task = NULL;
+static TickType_t probes_period;
+
+static volatile probes_state_t probes_state = PROBES_IDLE;
+static volatile bool probes_discard_pending;
+static volatile unsigned int probes_quiet_count; // buses silent this cycle, guarded by probes_mux
+static volatile bool probes_quiet_lost;          // a bus started late this cycle, guarded by probes_mux
+static probes_hook_t probes_quiet_hook;
+static probes_hook_t probes_ready_hook;
+static probes_hook_t probes_alarm_hook;
+static volatile bool probes_sweeping;   // bus tasks are woken for an alarm sweep
+static volatile unsigned int probes_resolution_pending;
+static volatile unsigned int probes_resolution = DS18B20_RESOLUTION_12_BIT;
+
+// alarm thresholds, guarded by probes_mux (generation 0 means not armed)
+static uint32_t probes_alarm_generation;
+static int8_t probes_alarm_high = DS18B20_TEMP_MAX;
+static int8_t probes_alarm_low = DS18B20_TEMP_MIN;
+
+// the published readings are shared between the worker and any consumer
+static portMUX_TYPE probes_mux = portMUX_INITIALIZER_UNLOCKED;
+static probes_reading_t probes_latest;
+
+// the probe measuring ambient rather than the block, guarded by probes_mux
+static probe_addr_t probes_ambient;
+static bool probes_ambient_valid;
+
+//-----------------------------------------------------------------------------
+// Full 1-Wire search of one bus for DS18B20 devices with a valid ROM CRC
+
+static unsigned int probes_search(gpio_num_t pin,onewire_addr_t *p_addrs,unsigned int max)
+{
+    TickType_t start = xTaskGetTickCount();
+    onewire_search_t search;
+    unsigned int count = 0;
+
+    if (0 == max)
+        return 0;
+
+    onewire_search_start(&search);
+    do {
+        onewire_addr_t addr = onewire_search_next(&search, pin);
+
+        if (ONEWIRE_NONE != addr) {
+            uint8_t rom[8];
+            unsigned int i;
+
+            for (i = 0; i < sizeof(rom); i++)
+                rom[i] = (uint8_t)(addr >> (8 * i));
+            if ((DS18B20_FAMILY == rom[0]) && (onewire_crc8(rom, 7) == rom[7]))
+                p_addrs[count++] = addr;
+            else
+                ESP_LOGW(p_tag,"Ignoring ROM 0x%llx on GPIO %d",addr,pin);
+        } else if ((xTaskGetTickCount() - start) >= (PROBES_SEARCH_TIMEOUT_MS / portTICK_PERIOD_MS)) {
+            ESP_LOGE(p_tag,"Error searching the 1wire bus on GPIO %d",pin);
+            break;
+        } else {
+            vTaskDelay(10); // avoids the watchdog triggering
+        }
+    } while (!search.last_device_found && (count < max));
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint32_t probes_alarm_get(int8_t *p_high,int8_t *p_low)
+{
+    uint32_t generation;
+
+    portENTER_CRITICAL(&probes_mux);
+    generation = probes_alarm_generation;
+    *p_high = probes_alarm_high;
+    *p_low = probes_alarm_low;
+    portEXIT_CRITICAL(&probes_mux);
+
+    return generation;
+}
+
+//-----------------------------------------------------------------------------
+
+static probes_bus_t *probes_bus(gpio_num_t pin)
+{
+    unsigned int i;
+
+    for (i = 0; i < PROBES_BUSES; i++) {
+        if (probes_buses[i].pin == pin)
+            return &probes_buses[i];
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static unsigned int probes_nvs_load(probe_addr_t *p_addrs,unsigned int max)
+{
+    size_t len = (max * sizeof(probe_addr_t));
+    nvs_handle handle;
+    esp_err_t ret;
+
+    ret = nvs_open(PROBES_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (ESP_OK != ret)
+        return 0;
+
+    ret = nvs_get_blob(handle, PROBES_NVS_KEY_ROMS, p_addrs, &len);
+    nvs_close(handle);
+    if (ESP_OK != ret)
+        return 0;
+
+    return (len / sizeof(probe_addr_t));
+}
+
+static void probes_nvs_store(const probe_addr_t *p_addrs,unsigned int count)
+{
+    nvs_handle handle;
+    esp_err_t ret;
+
+    ret = nvs_open(PROBES_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ESP_OK == ret) {
+        ret = nvs_set_blob(handle, PROBES_NVS_KEY_ROMS, p_addrs, (count * sizeof(probe_addr_t)));
+        if (ESP_OK == ret)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGW(p_tag,"Failed to cache probe ROMs (%s)",esp_err_to_name(ret));
+    }
+}
+
+//-----------------------------------------------------------------------------
+/* Merge a search of one bus into the registry. Must hold the lock of that
+   bus, since new arrivals are configured on the bus before being added. */
+
+static bool probes_registry_update(gpio_num_t pin,const onewire_addr_t *p_found,unsigned int found)
+{
+    unsigned int resolution = probes_resolution;
+    int8_t alarm_high, alarm_low;
+    uint32_t alarm_generation = probes_alarm_get(&alarm_high, &alarm_low);
+    bool changed = false;
+    unsigned int i, j;
+
+    xSemaphoreTake(probes_registry_lock, portMAX_DELAY);
+
+    // retire probes on this bus that have been missing from several searches
+    for (i = 0; i < probe_count; ) {
+        if (probe_addrs[i].bus == pin) {
+            for (j = 0; (j < found) && (p_found[j] != probe_addrs[i].rom); j++)
+                ;
+            if (j < found) {
+                probe_misses[i] = 0;
+            } else if (++probe_misses[i] >= PROBES_RETIRE_MISSES) {
+                ESP_LOGW(p_tag,"Probe %d:0x%llx retired",pin,probe_addrs[i].rom);
+                probe_count--;
+                memmove(&probe_addrs[i], &probe_addrs[i + 1], ((probe_count - i) * sizeof(probe_addrs[0])));
+                memmove(&probe_misses[i], &probe_misses[i + 1], ((probe_count - i) * sizeof(probe_misses[0])));
+                changed = true;
+                continue;
+            }
+        }
+        i++;
+    }
+
+    // add new arrivals at the current resolution and alarm thresholds
+    for (j = 0; j < found; j++) {
+        for (i = 0; (i < probe_count) && ((probe_addrs[i].bus != pin) || (probe_addrs[i].rom != p_found[j])); i++)
+            ;
+        if ((i == probe_count) && (probe_count < PROBES_MAX)) {
+            ESP_LOGI(p_tag,"Probe %d:0x%llx added",pin,p_found[j]);
+            if (DS18B20_RESOLUTION_12_BIT != resolution)
+                (void)ds18b20_set_resolution(pin, p_found[j], resolution, false);
+            if (alarm_generation)
+                (void)ds18b20_set_alarm(pin, p_found[j], alarm_high, alarm_low, false);
+            probe_addrs[probe_count].bus = pin;
+            probe_addrs[probe_count].rom = p_found[j];
+            probe_misses[probe_count] = 0;
+            probe_count++;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        probe_generation++;
+
+    xSemaphoreGive(probes_registry_lock);
+
+    return changed;
+}
+
+//-----------------------------------------------------------------------------
+/* Background search for hot-plugged probes. The first pass runs straight
+   away, which also refreshes the NVS cache when booting from a stale one. */
+
+static void probes_rescan_worker(void *p_arg)
+{
+    onewire_addr_t found[PROBES_MAX];
+    probe_addr_t cache[PROBES_MAX];
+    unsigned int count;
+    unsigned int b;
+    bool changed;
+
+    for (;;) {
+        changed = false;
+        for (b = 0; b < PROBES_BUSES; b++) {
+            probes_bus_t *p_bus = &probes_buses[b];
+
+            xSemaphoreTake(p_bus->lock, portMAX_DELAY);
+            count = probes_search(p_bus->pin, found, PROBES_MAX);
+            if (probes_registry_update(p_bus->pin, found, count))
+                changed = true;
+            xSemaphoreGive(p_bus->lock);
+        }
+
+        if (changed) {
+            xSemaphoreTake(probes_registry_lock, portMAX_DELAY);
+            count = probe_count;
+            memcpy(cache, probe_addrs, (count * sizeof(probe_addr_t)));
+            xSemaphoreGive(probes_registry_lock);
+
+            ESP_LOGI(p_tag,"%u live probe%s",count,((1 == count) ? "" : "s"));
+            probes_nvs_store(cache, count);
+        }
+
+        vTaskDelay(PROBES_RESCAN_MS / portTICK_PERIOD_MS);
+    }
+}
+
+//-----------------------------------------------------------------------------
+/* A bus has no more traffic until its conversion completes. There is no
+   quiet window in a cycle where a bus started late, since the others may
+   already be reading back by the time it converts. */
+
+static void probes_bus_quiet(void)
+{
+    bool all;
+
+    portENTER_CRITICAL(&probes_mux);
+    all = ((PROBES_BUSES == ++probes_quiet_count) && !probes_quiet_lost);
+    portEXIT_CRITICAL(&probes_mux);
+
+    if (all && probes_quiet_hook)
+        probes_quiet_hook();
+}
+
+//-----------------------------------------------------------------------------
+// Conversion complete: wake the bus task to read the scratchpads
+
+static void probes_timer_callback(void *p_arg)
+{
+    probes_bus_t *p_bus = (probes_bus_t *)p_arg;
+
+    xTaskNotifyGive(p_bus->task);
+}
+
+//-----------------------------------------------------------------------------
+/* An alarm sweep on a single bus: convert, then one Alarm Search. A bus busy
+   with a rescan is skipped, and a failed conversion clears the alarm rather
+   than leave a stale one. */
+
+static void probes_bus_sweep(probes_bus_t *p_bus)
+{
+    onewire_addr_t alarms[PROBES_MAX];
+    uint32_t alarm = 0;
+    unsigned int count;
+    unsigned int i, j;
+
+    p_bus->swept = false;
+    if (pdTRUE != xSemaphoreTake(p_bus->lock, 0))
+        return;
+
+    if (p_bus->count && p_bus->alarm_generation) {
+        if (ds18b20_convert_all(p_bus->pin)) {
+            esp_timer_start_once(p_bus->timer, ds18b20_conversion_max_us(p_bus->addrs, p_bus->count));
+            (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            count = ds18b20_alarm_search(p_bus->pin, alarms, PROBES_MAX);
+            for (j = 0; j < count; j++) {
+                for (i = 0; i < p_bus->count; i++) {
+                    if (p_bus->addrs[i] == alarms[j])
+                        alarm |= (1 << i);
+                }
+            }
+            p_bus->swept = true;
+        }
+        p_bus->in_alarm = (0 != alarm);
+    }
+
+    xSemaphoreGive(p_bus->lock);
+}
+
+//-----------------------------------------------------------------------------
+/* One conversion cycle (or alarm sweep) on a single bus, started by a
+   notification from the coordinator. The same notification is then used by
+   the conversion timer, which cannot fire until the cycle has been started. */
+
+static void probes_bus_worker(void *p_arg)
+{
+    probes_bus_t *p_bus = (probes_bus_t *)p_arg;
+    unsigned int resolution;
+    uint32_t alarm_generation;
+    int8_t alarm_high, alarm_low;
+    unsigned int i;
+
+    for (;;) {
+        (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (probes_sweeping) {
+            probes_bus_sweep(p_bus);
+            xTaskNotifyGive(probes_task);
+            continue;
+        }
+
+        // the probes on this bus cannot change while we hold its lock
+        if (pdTRUE != xSemaphoreTake(p_bus->lock, 0)) {
+            // a rescan is searching this bus, so it will convert late
+            portENTER_CRITICAL(&probes_mux);
+            probes_quiet_lost = true;
+            portEXIT_CRITICAL(&probes_mux);
+            xSemaphoreTake(p_bus->lock, portMAX_DELAY);
+        }
+
+        p_bus->count = 0;
+        xSemaphoreTake(probes_registry_lock, portMAX_DELAY);
+        for (i = 0; i < probe_count; i++) {
+            if (probe_addrs[i].bus == p_bus->pin)
+                p_bus->addrs[p_bus->count++] = probe_addrs[i].rom;
+        }
+        xSemaphoreGive(probes_registry_lock);
+
+        // resolution changes are applied between conversions
+        resolution = probes_resolution;
+        if (resolution != p_bus->resolution) {
+            p_bus->resolution = resolution;
+            for (i = 0; i < p_bus->count; i++) {
+                if (!ds18b20_set_resolution(p_bus->pin, p_bus->addrs[i], resolution, false))
+                    ESP_LOGW(p_tag,"Failed to set %u-bit resolution on %d:0x%llx",resolution,p_bus->pin,p_bus->addrs[i]);
+            }
+        }
+
+        // as are alarm threshold changes
+        alarm_generation = probes_alarm_get(&alarm_high, &alarm_low);
+        if (alarm_generation != p_bus->alarm_generation) {
+            p_bus->alarm_generation = alarm_generation;
+            for (i = 0; i < p_bus->count; i++) {
+                if (!ds18b20_set_alarm(p_bus->pin, p_bus->addrs[i], alarm_high, alarm_low, false))
+                    ESP_LOGW(p_tag,"Failed to set alarm thresholds on %d:0x%llx",p_bus->pin,p_bus->addrs[i]);
+            }
+        }
+
+        p_bus->valid = 0;
+        p_bus->alarm = 0;
+        p_bus->converted = (p_bus->count && ds18b20_convert_all(p_bus->pin));
+        probes_bus_quiet();
+        if (p_bus->converted) {
+            esp_timer_start_once(p_bus->timer, ds18b20_conversion_max_us(p_bus->addrs, p_bus->count));
+            (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            for (i = 0; i < p_bus->count; i++) {
+                p_bus->temps[i] = 0;
+                if (ESP_OK == ds18b20_read_temp(p_bus->pin, p_bus->addrs[i], &p_bus->temps[i])) {
+                    p_bus->valid |= (1 << i);
+                    // the same test as the probe's own, on the integer part
+                    if (p_bus->alarm_generation && ((floorf(p_bus->temps[i]) >= alarm_high) || (floorf(p_bus->temps[i]) <= alarm_low)))
+                        p_bus->alarm |= (1 << i);
+                } else {
+                    ds18b20_stats_t stats;
+                    (void)ds18b20_get_stats(p_bus->addrs[i], &stats);
+                    ESP_LOGW(p_tag,"Probe %d:0x%llx read failed (%u of %u reads, %u CRC, %u presence)",p_bus->pin,p_bus->addrs[i],stats.failures,stats.reads,stats.crc_errors,stats.presence_errors);
+                }
+            }
+        } else if (p_bus->count) {
+            ESP_LOGW(p_tag,"No presence pulse on 1-Wire bus GPIO %d",p_bus->pin);
+        }
+        // nothing read means nothing known to be out of band
+        p_bus->in_alarm = (0 != p_bus->alarm);
+
+        xSemaphoreGive(p_bus->lock);
+        xTaskNotifyGive(probes_task);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Wake every bus task and wait until each has reported back exactly once
+
+static void probes_run_buses(void)
+{
+    unsigned int pending;
+    unsigned int b;
+
+    for (b = 0; b < PROBES_BUSES; b++)
+        xTaskNotifyGive(probes_buses[b].task);
+
+    pending = PROBES_BUSES;
+    while (pending) {
+        uint32_t done = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        pending -= ((done < pending) ? done : pending);
+    }
+}
+
+//-----------------------------------------------------------------------------
+/* Fill the rest of the period with alarm sweeps, starting one only while it
+   fits before the next cycle is due. The first is assumed to take as long as
+   the full cycle just run, later ones as long as the previous sweep. */
+
+static void probes_alarm_sweeps(TickType_t last_wake,TickType_t duration)
+{
+    int8_t alarm_high, alarm_low;
+    bool alarm = probes_alarm();
+    bool swept;
+    TickType_t start;
+    unsigned int b;
+
+    while (probes_alarm_get(&alarm_high, &alarm_low) && (((xTaskGetTickCount() - last_wake) + duration) < probes_period)) {
+        start = xTaskGetTickCount();
+        probes_sweeping = true;
+        probes_run_buses();
+        probes_sweeping = false;
+        duration = (xTaskGetTickCount() - start);
+
+        if ((alarm != probes_alarm()) && probes_alarm_hook)
+            probes_alarm_hook();
+        alarm = probes_alarm();
+
+        // with no conversion to wait for, another sweep would only spin
+        swept = false;
+        for (b = 0; b < PROBES_BUSES; b++)
+            swept |= probes_buses[b].swept;
+        if (!swept)
+            break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Run a cycle on every bus at once and publish the combined readings
+
+static void probes_worker(void *p_arg)
+{
+    TickType_t last_wake = xTaskGetTickCount();
+    TickType_t start;
+    probes_reading_t reading;
+    bool converted;
+    unsigned int b, i;
+
+    for (;;) {
+        probes_discard_pending = false;
+
+        if (probes_resolution_pending) {
+            probes_resolution = probes_resolution_pending;
+            probes_resolution_pending = 0;
+        }
+
+        portENTER_CRITICAL(&probes_mux);
+        probes_quiet_count = 0;
+        probes_quiet_lost = false;
+        portEXIT_CRITICAL(&probes_mux);
+
+        probes_state = PROBES_CONVERTING;
+        start = xTaskGetTickCount();
+        probes_run_buses();
+
+        xSemaphoreTake(probes_registry_lock, portMAX_DELAY);
+        reading.generation = probe_generation;
+        xSemaphoreGive(probes_registry_lock);
+
+        converted = false;
+        reading.count = 0;
+        reading.valid = 0;
+        reading.alarm = 0;
+        for (b = 0; b < PROBES_BUSES; b++) {
+            const probes_bus_t *p_bus = &probes_buses[b];
+
+            if (!p_bus->converted)
+                continue;
+            converted = true;
+            for (i = 0; (i < p_bus->count) && (reading.count < PROBES_MAX); i++) {
+                reading.addrs[reading.count].bus = p_bus->pin;
+                reading.addrs[reading.count].rom = p_bus->addrs[i];
+                reading.temps[reading.count] = p_bus->temps[i];
+                if (p_bus->valid & (1 << i))
+                    reading.valid |= (1 << reading.count);
+                if (p_bus->alarm & (1 << i))
+                    reading.alarm |= (1 << reading.count);
+                reading.count++;
+            }
+        }
+        reading.timestamp = esp_timer_get_time();
+
+        if (!converted) {
+            probes_state = PROBES_IDLE;
+        } else if (probes_discard_pending) {
+            // a bus was disturbed during this conversion: start again
+            last_wake = xTaskGetTickCount();
+            continue;
+        } else {
+            portENTER_CRITICAL(&probes_mux);
+            reading.sequence = (probes_latest.sequence + 1);
+            if (0 == reading.sequence)
+                reading.sequence = 1;
+            probes_latest = reading;
+            portEXIT_CRITICAL(&probes_mux);
+
+            probes_state = PROBES_READY;
+            if (probes_ready_hook)
+                probes_ready_hook();
+
+            probes_alarm_sweeps(last_wake, (xTaskGetTickCount() - start));
+        }
+
+        vTaskDelayUntil(&last_wake, probes_period);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Find the probes for the initial registry
+
+static unsigned int probes_discover(probe_addr_t *p_addrs,unsigned int max)
+{
+    onewire_addr_t found[PROBES_MAX];
+    unsigned int count;
+    unsigned int b, i, j;
+
+    // a quick per-ROM check of the cached table avoids the full search
+    count = probes_nvs_load(p_addrs, max);
+    for (i = 0; i < count; i++) {
+        float temp;
+        if ((NULL == probes_bus(p_addrs[i].bus)) || (ESP_OK != ds18b20_read_temp(p_addrs[i].bus, p_addrs[i].rom, &temp)))
+            break;
+    }
+
+    if (count && (i == count)) {
+        ESP_LOGI(p_tag,"Verified %u cached probe%s",count,((1 == count) ? "" : "s"));
+    } else {
+        if (count)
+            ESP_LOGW(p_tag,"Cached probe %d:0x%llx not responding: searching buses",p_addrs[i].bus,p_addrs[i].rom);
+        count = 0;
+        for (b = 0; b < PROBES_BUSES; b++) {
+            unsigned int found_count = probes_search(probes_buses[b].pin, found, (max - count));
+            for (j = 0; j < found_count; j++) {
+                p_addrs[count].bus = probes_buses[b].pin;
+                p_addrs[count].rom = found[j];
+                count++;
+            }
+        }
+        probes_nvs_store(p_addrs, count);
+    }
+
+    for (i = 0; i < count; i++)
+        ESP_LOGI(p_tag,"Probe %u: %d:0x%llx",i,p_addrs[i].bus,p_addrs[i].rom);
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+
+unsigned int probes_init(void)
+{
+    unsigned int b;
+
+    if (NULL == probes_registry_lock) {
+        probes_registry_lock = xSemaphoreCreateMutex();
+        if (NULL == probes_registry_lock) {
+            ESP_LOGE(p_tag,"Failed to create registry lock");
+            return 0;
+        }
+    }
+
+    for (b = 0; b < PROBES_BUSES; b++) {
+        probes_bus_t *p_bus = &probes_buses[b];
+
+        p_bus->pin = probes_bus_pins[b];
+        p_bus->resolution = DS18B20_RESOLUTION_12_BIT;
+        if (NULL == p_bus->lock) {
+            p_bus->lock = xSemaphoreCreateMutex();
+            if (NULL == p_bus->lock) {
+                ESP_LOGE(p_tag,"Failed to create bus lock");
+                return 0;
+            }
+        }
+        if (NULL == p_bus->timer) {
+            const esp_timer_create_args_t timer_args = {
+                .callback = probes_timer_callback,
+                .arg = p_bus,
+                .name = "probes"
+            };
+            esp_err_t ret = esp_timer_create(&timer_args, &p_bus->timer);
+            if (ESP_OK != ret) {
+                ESP_LOGE(p_tag,"Failed to create conversion timer (%s)",esp_err_to_name(ret));
+                return 0;
+            }
+        }
+    }
+
+    {
+        probe_addr_t ambient;
+        size_t len = sizeof(ambient);
+        nvs_handle handle;
+
+        if (ESP_OK == nvs_open(PROBES_NVS_NAMESPACE, NVS_READONLY, &handle)) {
+            if ((ESP_OK == nvs_get_blob(handle, PROBES_NVS_KEY_AMBIENT, &ambient, &len)) && (sizeof(ambient) == len)) {
+                ESP_LOGI(p_tag,"Ambient probe %d:0x%llx",ambient.bus,ambient.rom);
+                portENTER_CRITICAL(&probes_mux);
+                probes_ambient = ambient;
+                probes_ambient_valid = true;
+                portEXIT_CRITICAL(&probes_mux);
+            }
+            nvs_close(handle);
+        }
+    }
+
+    xSemaphoreTake(probes_registry_lock, portMAX_DELAY);
+    probe_count = probes_discover(probe_addrs, PROBES_MAX);
+    memset(probe_misses, 0, sizeof(probe_misses));
+    probe_generation++;
+    xSemaphoreGive(probes_registry_lock);
+
+    return probe_count;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t probes_start(uint32_t period_ms)
+{
+    unsigned int b;
+
+    if (NULL == probes_registry_lock)
+        return ESP_ERR_INVALID_STATE;
+    if (probes_task)
+        return ESP_OK; // already running
+
+    // never shorter than a full resolution conversion
+    if (period_ms < (ds18b20_conversion_us(DS18B20_RESOLUTION_12_BIT) / 1000))
+        period_ms = (ds18b20_conversion_us(DS18B20_RESOLUTION_12_BIT) / 1000);
+    probes_period = ((period_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+
+    for (b = 0; b < PROBES_BUSES; b++) {
+        char name[configMAX_TASK_NAME_LEN];
+
+        snprintf(name, sizeof(name), "probes%d", probes_buses[b].pin);
+        if (pdPASS != xTaskCreate(probes_bus_worker, name, PROBES_BUS_STACK, &probes_buses[b], PROBES_BUS_PRIORITY, &probes_buses[b].task)) {
+            ESP_LOGE(p_tag,"Failed to create bus task for GPIO %d",probes_buses[b].pin);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    if (pdPASS != xTaskCreate(probes_worker, "probes", PROBES_TASK_STACK, NULL, PROBES_TASK_PRIORITY, &probes_task)) {
+        ESP_LOGE(p_tag,"Failed to create acquisition task");
+        return ESP_ERR_NO_MEM;
+    }
+    if (pdPASS != xTaskCreate(probes_rescan_worker, "probes_scan", PROBES_RESCAN_STACK, NULL, PROBES_RESCAN_PRIORITY, &probes_rescan_task)) {
+        ESP_LOGW(p_tag,"Failed to create rescan task: probe set is fixed");
+    }
+
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+probes_state_t probes_get_state(void)
+{
+    return probes_state;
+}
+
+//-----------------------------------------------------------------------------
+
+bool probes_get_latest(probes_reading_t *p_reading)
+{
+    bool valid;
+
+    portENTER_CRITICAL(&probes_mux);
+    *p_reading = probes_latest;
+    portEXIT_CRITICAL(&probes_mux);
+
+    valid = (0 != p_reading->sequence);
+    return valid;
+}
+
+//-----------------------------------------------------------------------------
+
+void probes_set_resolution(unsigned int resolution)
+{
+    if ((resolution != probes_resolution) || probes_resolution_pending)
+        probes_resolution_pending = resolution;
+}
+
+//-----------------------------------------------------------------------------
+
+void probes_set_alarm(int8_t high,int8_t low)
+{
+    portENTER_CRITICAL(&probes_mux);
+    probes_alarm_high = high;
+    probes_alarm_low = low;
+    if (0 == ++probes_alarm_generation)
+        probes_alarm_generation = 1;
+    portEXIT_CRITICAL(&probes_mux);
+}
+
+//-----------------------------------------------------------------------------
+
+bool probes_alarm(void)
+{
+    unsigned int b;
+
+    for (b = 0; b < PROBES_BUSES; b++) {
+        if (probes_buses[b].in_alarm)
+            return true;
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t probes_set_ambient(const probe_addr_t *p_probe)
+{
+    nvs_handle handle;
+    esp_err_t ret;
+
+    // only a probe currently in the registry can be nominated
+    if (p_probe) {
+        unsigned int i;
+
+        if (NULL == probes_bus(p_probe->bus))
+            return ESP_ERR_INVALID_ARG;
+        if (NULL == probes_registry_lock)
+            return ESP_ERR_NOT_FOUND;
+
+        xSemaphoreTake(probes_registry_lock, portMAX_DELAY);
+        for (i = 0; (i < probe_count) && ((probe_addrs[i].bus != p_probe->bus) || (probe_addrs[i].rom != p_probe->rom)); i++)
+            ;
+        xSemaphoreGive(probes_registry_lock);
+        if (i == probe_count)
+            return ESP_ERR_NOT_FOUND;
+    }
+
+    portENTER_CRITICAL(&probes_mux);
+    if (p_probe)
+        probes_ambient = *p_probe;
+    probes_ambient_valid = (NULL != p_probe);
+    portEXIT_CRITICAL(&probes_mux);
+
+    ret = nvs_open(PROBES_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ESP_OK == ret) {
+        if (p_probe)
+            ret = nvs_set_blob(handle, PROBES_NVS_KEY_AMBIENT, p_probe, sizeof(*p_probe));
+        else
+            ret = nvs_erase_key(handle, PROBES_NVS_KEY_AMBIENT);
+        if ((ESP_OK == ret) || (ESP_ERR_NVS_NOT_FOUND == ret))
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGW(p_tag,"Failed to save ambient probe (%s)",esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+bool probes_get_ambient(probe_addr_t *p_probe)
+{
+    bool valid;
+
+    portENTER_CRITICAL(&probes_mux);
+    *p_probe = probes_ambient;
+    valid = probes_ambient_valid;
+    portEXIT_CRITICAL(&probes_mux);
+
+    return valid;
+}
+
+//-----------------------------------------------------------------------------
+
+void probes_discard(void)
+{
+    probes_discard_pending = true;
+}
+
+//-----------------------------------------------------------------------------
+
+void probes_set_quiet_hook(probes_hook_t hook)
+{
+    probes_quiet_hook = hook;
+}
+
+//-----------------------------------------------------------------------------
+
+void probes_set_ready_hook(probes_hook_t hook)
+{
+    probes_ready_hook = hook;
+}
+
+//-----------------------------------------------------------------------------
+
+void probes_set_alarm_hook(probes_hook_t hook)
+{
+    probes_alarm_hook = hook;
+}
+
+//=============================================================================
+// EOF probes.c
@@ -0,0 +1,191 @@
+// probes.h
+//=============================================================================
+
+#if !defined(__probes_h)
+#define __probes_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "driver/gpio.h"
+
+#include "onewire.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define PROBES_MAX (8) // maximum number of DS18B20 probes tracked (all buses)
+
+// A probe is identified by the bus it is attached to and its ROM address
+typedef struct {
+    gpio_num_t bus;             // GPIO of the 1-Wire bus
+    onewire_addr_t rom;         // 64-bit ROM address
+} probe_addr_t;
+
+// Acquisition engine state
+typedef enum {
+    PROBES_IDLE,        // no conversion in progress
+    PROBES_CONVERTING,  // Convert T issued, waiting for completion
+    PROBES_READY        // latest readings published
+} probes_state_t;
+
+// Acquisition event callback (see probes_set_quiet_hook(), probes_set_ready_hook(),
+// probes_set_alarm_hook())
+typedef void (*probes_hook_t)(void);
+
+// A complete set of readings from one conversion cycle across all buses
+typedef struct {
+    int64_t timestamp;          // esp_timer_get_time() when the readings were taken
+    uint32_t sequence;          // incremented for every published set (0 is never published)
+    uint32_t generation;        // registry generation the set was taken from
+    unsigned int count;         // number of live probes in this set
+    uint32_t valid;             // bit n set if temps[n] passed validation
+    uint32_t alarm;             // bit n set if addrs[n] was outside the alarm thresholds
+    probe_addr_t addrs[PROBES_MAX]; // bus and ROM address of each live probe
+    float temps[PROBES_MAX];    // degrees Celsius, in addrs[] order
+} probes_reading_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise the acquisition engine and populate the probe registry from
+ * every bus in ONEWIRE_BUS_PINS. The table cached in NVS by a previous boot
+ * is verified with a per-ROM scratchpad read, and the full bus searches only
+ * run if the cache is missing or a cached probe does not answer.
+ *
+ * @return number of live probes found.
+ */
+extern unsigned int probes_init(void);
+
+/**
+ * Start continuous acquisition. Every period_ms each bus task issues its own
+ * bus-wide conversion and reads its probes, with the completion scheduled by
+ * a per-bus esp_timer, so the buses run concurrently and no caller ever waits
+ * on 1-Wire. The readings from all buses are published as one set. A low
+ * priority task also rescans the buses between conversions to add or retire
+ * probes; the NVS cache follows the registry.
+ *
+ * @param period_ms Interval between conversions in milliseconds.
+ * @return ESP_OK on success, or standard esp-idf error encoding.
+ */
+extern esp_err_t probes_start(uint32_t period_ms);
+
+/**
+ * Get the current acquisition engine state.
+ */
+extern probes_state_t probes_get_state(void);
+
+/**
+ * Copy the most recently completed set of readings.
+ *
+ * @param p_reading Pointer to structure to be filled.
+ * @return true if a reading has been published, false if none yet.
+ */
+extern bool probes_get_latest(probes_reading_t *p_reading);
+
+/**
+ * Request a new conversion resolution for all probes. The change is applied
+ * by the acquisition task before its next conversion, and the conversion wait
+ * follows the datasheet time for the new resolution.
+ *
+ * @param resolution Resolution in bits (DS18B20_RESOLUTION_9_BIT .. 12_BIT).
+ */
+extern void probes_set_resolution(unsigned int resolution);
+
+/**
+ * Arm the out-of-band check on all probes. The thresholds are programmed into
+ * every probe (and any probe added later) before its next conversion. The
+ * full readings are then checked against them, and between full readings
+ * each bus runs alarm sweeps (a conversion and a single Alarm Search) for as
+ * long as one fits before the next reading is due.
+ *
+ * @param high Over-temperature threshold in degrees Celsius.
+ * @param low Under-temperature threshold in degrees Celsius.
+ */
+extern void probes_set_alarm(int8_t high, int8_t low);
+
+/**
+ * Check the result of the latest alarm check: the full readings, or an alarm
+ * sweep since. A bus whose conversion failed is not in alarm.
+ *
+ * @return true if any probe was outside the thresholds set by
+ *         probes_set_alarm().
+ */
+extern bool probes_alarm(void);
+
+/**
+ * Nominate the probe that measures ambient rather than the heater block. It
+ * is still read with the others; the setting is saved in NVS.
+ *
+ * @param p_probe Bus and ROM of the ambient probe, or NULL for none.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the bus is not a
+ *         configured 1-Wire bus, ESP_ERR_NOT_FOUND if the probe is not a live
+ *         probe on that bus, or standard esp-idf error encoding.
+ */
+extern esp_err_t probes_set_ambient(const probe_addr_t *p_probe);
+
+/**
+ * Get the probe nominated by probes_set_ambient().
+ *
+ * @param p_probe Filled with the bus and ROM of the ambient probe.
+ * @return false if no ambient probe has been nominated.
+ */
+extern bool probes_get_ambient(probe_addr_t *p_probe);
+
+/**
+ * Discard any conversion in progress and start a new one as soon as
+ * possible. Used after an actuator change made outside the quiet window so
+ * that readings taken while the bus was disturbed are never published.
+ */
+extern void probes_discard(void);
+
+/**
+ * Register a function to be called once per acquisition cycle, as soon as
+ * every bus has issued its Convert T. No bus has any traffic from then until
+ * the conversions complete (at least the 9-bit conversion time), so changes
+ * made in the hook cannot disturb a 1-Wire slot. The hook is not called in a
+ * cycle where a bus was still busy with a search for new probes, since that
+ * bus converts too late for a common quiet window. The hook is called from a
+ * bus task and must not block.
+ *
+ * @param hook Function to call, or NULL for none.
+ */
+extern void probes_set_quiet_hook(probes_hook_t hook);
+
+/**
+ * Register a function to be called each time a new set of readings is
+ * published. The hook is called from the acquisition task and must not
+ * block.
+ *
+ * @param hook Function to call, or NULL for none.
+ */
+extern void probes_set_ready_hook(probes_hook_t hook);
+
+/**
+ * Register a function to be called when an alarm sweep between full readings
+ * changes the result of probes_alarm(). The hook is called from the
+ * acquisition task and must not block.
+ *
+ * @param hook Function to call, or NULL for none.
+ */
+extern void probes_set_alarm_hook(probes_hook_t hook);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__probes_h
+
+//=============================================================================
+// EOF probes.h
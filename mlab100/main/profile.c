@@ -0,0 +1,303 @@
+// profile.c
+//=============================================================================
+/*
+ * Temperature profile (ramp/soak program) engine.
+ *
+ * A program is a table of steps, each ramping the setpoint to a target at a
+ * given rate and then holding it there for a given time:
+ *
+ *   RAMP --(setpoint at target)--> SETTLE --(block within band)--> HOLD
+ *     ^                                                             |
+ *     +---------------------(hold time elapsed)---------------------+--> DONE
+ *
+ * The hold only starts once the block has actually reached the target, so
+ * every step gets its full soak however slowly the block follows the ramp.
+ * Each tick does a fixed amount of work for the current step.
+ *
+ * The program is saved in NVS when loaded, and the run is checkpointed on
+ * every phase change and periodically while ramping or holding, so an
+ * interrupted run resumes after a reboot having lost at most one checkpoint
+ * interval. The interval bounds the NVS writes a long program makes.
+ *
+ * All calls are made from the control loop, so no locking is needed.
+ */
+
+//=============================================================================
+
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "profile.h"
+
+//-----------------------------------------------------------------------------
+
+static const char *p_tag = "profile"; // for esp-idf logging
+
+#define PROFILE_SETTLE_BAND     (0.5f) // degrees either side of the target
+#define PROFILE_CHECKPOINT_S    (10 * 60) // longest run time between checkpoints
+
+#define PROFILE_NVS_NAMESPACE   "profile"
+#define PROFILE_NVS_KEY_STEPS   "steps" // program blob as loaded
+#define PROFILE_NVS_KEY_RUN     "run"   // profile_checkpoint_t
+
+// Progress saved in NVS
+typedef struct {
+    uint8_t phase;
+    uint8_t step;
+    uint16_t reserved;
+    float setpoint;
+    uint32_t held_s;
+} profile_checkpoint_t;
+
+//-----------------------------------------------------------------------------
+
+static profile_step_t profile_steps[PROFILE_MAX_STEPS];
+static unsigned int profile_count;
+
+static profile_phase_t profile_phase = PROFILE_IDLE;
+static unsigned int profile_step;
+static float profile_setpoint;
+static float profile_held;              // seconds held on the current step
+static float profile_unsaved;           // run seconds since the last checkpoint
+
+//-----------------------------------------------------------------------------
+// Validate a program blob and unpack its steps
+
+static esp_err_t profile_parse(const uint8_t *p_blob,size_t len,profile_step_t *p_steps,unsigned int *p_count)
+{
+    profile_header_t header;
+    unsigned int i;
+
+    if (len < sizeof(header))
+        return ESP_ERR_INVALID_SIZE;
+    (void)memcpy(&header, p_blob, sizeof(header));
+
+    if ((PROFILE_VERSION != header.version) || (0 == header.count) || (header.count > PROFILE_MAX_STEPS))
+        return ESP_ERR_INVALID_ARG;
+    if (len != (sizeof(header) + (header.count * sizeof(profile_step_t))))
+        return ESP_ERR_INVALID_SIZE;
+
+    (void)memcpy(p_steps, (p_blob + sizeof(header)), (header.count * sizeof(profile_step_t)));
+    for (i = 0; i < header.count; i++) {
+        if ((p_steps[i].fan > PROFILE_FAN_ON) || p_steps[i].reserved)
+            return ESP_ERR_INVALID_ARG;
+        if ((p_steps[i].target < (PROFILE_TARGET_MIN * 100)) || (p_steps[i].target > (PROFILE_TARGET_MAX * 100)))
+            return ESP_ERR_INVALID_ARG;
+    }
+
+    *p_count = header.count;
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+static void profile_checkpoint(void)
+{
+    profile_checkpoint_t run;
+    nvs_handle handle;
+    esp_err_t ret;
+
+    memset(&run, 0, sizeof(run));
+    run.phase = profile_phase;
+    run.step = profile_step;
+    run.setpoint = profile_setpoint;
+    run.held_s = (uint32_t)profile_held;
+    profile_unsaved = 0;
+
+    ret = nvs_open(PROFILE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ESP_OK == ret) {
+        if (PROFILE_IDLE == profile_phase) {
+            ret = nvs_erase_key(handle, PROFILE_NVS_KEY_RUN);
+            if (ESP_ERR_NVS_NOT_FOUND == ret)
+                ret = ESP_OK;
+        } else {
+            ret = nvs_set_blob(handle, PROFILE_NVS_KEY_RUN, &run, sizeof(run));
+        }
+        if (ESP_OK == ret)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGW(p_tag,"Failed to checkpoint run (%s)",esp_err_to_name(ret));
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static void profile_enter(profile_phase_t phase)
+{
+    profile_phase = phase;
+    ESP_LOGI(p_tag,"Step %u/%u %s",(profile_step + 1),profile_count,((PROFILE_RAMP == phase) ? "ramp" : ((PROFILE_SETTLE == phase) ? "settle" : ((PROFILE_HOLD == phase) ? "hold" : "done"))));
+    profile_checkpoint();
+}
+
+//-----------------------------------------------------------------------------
+
+bool profile_restore(void)
+{
+    uint8_t blob[PROFILE_BLOB_MAX];
+    profile_checkpoint_t run;
+    size_t len = sizeof(blob);
+    nvs_handle handle;
+    bool resumed = false;
+
+    if (ESP_OK != nvs_open(PROFILE_NVS_NAMESPACE, NVS_READONLY, &handle))
+        return false;
+
+    if ((ESP_OK == nvs_get_blob(handle, PROFILE_NVS_KEY_STEPS, blob, &len)) && (ESP_OK == profile_parse(blob, len, profile_steps, &profile_count))) {
+        ESP_LOGI(p_tag,"Restored %u step program",profile_count);
+
+        len = sizeof(run);
+        if ((ESP_OK == nvs_get_blob(handle, PROFILE_NVS_KEY_RUN, &run, &len)) && (sizeof(run) == len) && (run.step < profile_count) && (run.phase > PROFILE_IDLE) && (run.phase <= PROFILE_DONE) && (run.setpoint >= PROFILE_TARGET_MIN) && (run.setpoint <= PROFILE_TARGET_MAX)) {
+            profile_phase = run.phase;
+            profile_step = run.step;
+            profile_setpoint = run.setpoint;
+            profile_held = run.held_s;
+            profile_unsaved = 0;
+            ESP_LOGI(p_tag,"Resuming step %u/%u (%u s held)",(profile_step + 1),profile_count,run.held_s);
+            resumed = true;
+        }
+    } else {
+        profile_count = 0;
+    }
+    nvs_close(handle);
+
+    return resumed;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t profile_load(const uint8_t *p_blob,size_t len)
+{
+    profile_step_t steps[PROFILE_MAX_STEPS];
+    unsigned int count;
+    nvs_handle handle;
+    esp_err_t ret;
+
+    ret = profile_parse(p_blob, len, steps, &count);
+    if (ESP_OK != ret) {
+        ESP_LOGW(p_tag,"Rejected program (%s)",esp_err_to_name(ret));
+        return ret;
+    }
+
+    profile_stop();
+    (void)memcpy(profile_steps, steps, sizeof(steps));
+    profile_count = count;
+    ESP_LOGI(p_tag,"Loaded %u step program",count);
+
+    ret = nvs_open(PROFILE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ESP_OK == ret) {
+        ret = nvs_set_blob(handle, PROFILE_NVS_KEY_STEPS, p_blob, len);
+        if (ESP_OK == ret)
+            ret = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    if (ESP_OK != ret) {
+        ESP_LOGW(p_tag,"Failed to save program (%s)",esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+esp_err_t profile_start(float setpoint)
+{
+    if (0 == profile_count)
+        return ESP_ERR_INVALID_STATE;
+
+    profile_step = 0;
+    profile_setpoint = setpoint;
+    profile_held = 0;
+    profile_enter(PROFILE_RAMP);
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+void profile_stop(void)
+{
+    if (PROFILE_IDLE != profile_phase) {
+        ESP_LOGI(p_tag,"Stopped at step %u/%u",(profile_step + 1),profile_count);
+        profile_phase = PROFILE_IDLE;
+        profile_checkpoint();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+bool profile_tick(float temperature,float dt,float *p_setpoint,profile_fan_t *p_fan)
+{
+    const profile_step_t *p_step;
+    float target;
+
+    if (PROFILE_IDLE == profile_phase)
+        return false;
+
+    p_step = &profile_steps[profile_step];
+    target = (p_step->target / 100.0f);
+    profile_unsaved += dt;
+
+    switch (profile_phase) {
+        case PROFILE_RAMP:
+            if (0 == p_step->ramp) {
+                profile_setpoint = target;
+            } else {
+                float delta = ((p_step->ramp / 100.0f) * (dt / 60));
+
+                if (fabsf(target - profile_setpoint) <= delta)
+                    profile_setpoint = target;
+                else
+                    profile_setpoint += ((target > profile_setpoint) ? delta : -delta);
+            }
+            if (target == profile_setpoint)
+                profile_enter(PROFILE_SETTLE);
+            else if (profile_unsaved >= PROFILE_CHECKPOINT_S)
+                profile_checkpoint(); // the setpoint has moved on
+            break;
+        case PROFILE_SETTLE:
+            if (fabsf(temperature - target) <= PROFILE_SETTLE_BAND) {
+                profile_held = 0;
+                profile_enter(PROFILE_HOLD);
+            }
+            break;
+        case PROFILE_HOLD:
+            profile_held += dt;
+            if ((PROFILE_HOLD_FOREVER != p_step->hold_s) && (profile_held >= p_step->hold_s)) {
+                profile_held = 0;
+                if ((profile_step + 1) < profile_count) {
+                    profile_step++;
+                    profile_enter(PROFILE_RAMP);
+                } else {
+                    profile_enter(PROFILE_DONE);
+                }
+            } else if (profile_unsaved >= PROFILE_CHECKPOINT_S) {
+                profile_checkpoint();
+            }
+            break;
+        default:
+            // PROFILE_DONE: hold the last target until stopped
+            break;
+    }
+
+    *p_setpoint = profile_setpoint;
+    *p_fan = (profile_fan_t)profile_steps[profile_step].fan;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void profile_get_status(profile_status_t *p_status)
+{
+    p_status->phase = profile_phase;
+    p_status->step = profile_step;
+    p_status->count = profile_count;
+    p_status->setpoint = profile_setpoint;
+    p_status->held_s = (uint32_t)profile_held;
+}
+
+//=============================================================================
+// EOF profile.c
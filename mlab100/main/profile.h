@@ -0,0 +1,139 @@
+// profile.h
+//=============================================================================
+
+#if !defined(__profile_h)
+#define __profile_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "ds18b20.h"
+#include "heater.h"
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define PROFILE_VERSION     (1)
+#define PROFILE_MAX_STEPS   (16)
+#define PROFILE_HOLD_FOREVER (0xFFFFFFFF) // hold_s: stay on this step until stopped
+
+// Step targets accepted, in degrees Celsius: within the DS18B20 range and
+// no higher than the heater setpoint limit (HEATER_SETPOINT_MAX)
+#define PROFILE_TARGET_MIN   (DS18B20_TEMP_MIN)
+#define PROFILE_TARGET_MAX   (HEATER_SETPOINT_MAX)
+
+// Fan policy for a step
+typedef enum {
+    PROFILE_FAN_AUTO,   // as chosen by the heater controller
+    PROFILE_FAN_OFF,
+    PROFILE_FAN_ON
+} profile_fan_t;
+
+/* One step of a program, in its little-endian wire (and NVS) format. The
+   setpoint ramps from where the previous step left it to the target, then
+   holds once the block has reached the target. */
+typedef struct {
+    int16_t target;     // centi-degrees Celsius, PROFILE_TARGET_MIN..PROFILE_TARGET_MAX
+    uint16_t ramp;      // centi-degrees Celsius per minute, 0 to step immediately
+    uint32_t hold_s;    // seconds to hold at the target, or PROFILE_HOLD_FOREVER
+    uint8_t fan;        // profile_fan_t
+    uint8_t reserved;   // must be 0
+} __attribute__((packed)) profile_step_t;
+
+/* A program blob is a profile_header_t followed by "count" steps. */
+typedef struct {
+    uint8_t version;    // PROFILE_VERSION
+    uint8_t count;      // number of steps (1..PROFILE_MAX_STEPS)
+} __attribute__((packed)) profile_header_t;
+
+#define PROFILE_BLOB_MAX (sizeof(profile_header_t) + (PROFILE_MAX_STEPS * sizeof(profile_step_t)))
+
+// Execution state
+typedef enum {
+    PROFILE_IDLE,       // not running
+    PROFILE_RAMP,       // setpoint moving towards the step target
+    PROFILE_SETTLE,     // setpoint at target, waiting for the block to reach it
+    PROFILE_HOLD,       // holding at the step target
+    PROFILE_DONE        // all steps completed, holding the last target
+} profile_phase_t;
+
+// Progress snapshot
+typedef struct {
+    profile_phase_t phase;
+    unsigned int step;      // current step index
+    unsigned int count;     // steps in the program
+    float setpoint;         // current setpoint in degrees Celsius
+    uint32_t held_s;        // seconds held on the current step
+} profile_status_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Restore the program and any run in progress saved in NVS, so a run
+ * interrupted by a reboot continues from its last checkpoint.
+ *
+ * @return true if a run was in progress and has been resumed.
+ */
+extern bool profile_restore(void);
+
+/**
+ * Replace the program with a blob received from the Client. Any run in
+ * progress is stopped. The program is saved in NVS.
+ *
+ * @param p_blob Program blob (profile_header_t and steps).
+ * @param len Length of the blob in bytes.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG or ESP_ERR_INVALID_SIZE if
+ *         the blob is malformed or a target is out of range, or an NVS error.
+ */
+extern esp_err_t profile_load(const uint8_t *p_blob, size_t len);
+
+/**
+ * Start the program from its first step.
+ *
+ * @param setpoint Current setpoint, from which the first ramp starts.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if no program is loaded.
+ */
+extern esp_err_t profile_start(float setpoint);
+
+/**
+ * Stop the program. The setpoint is left where it is.
+ */
+extern void profile_stop(void);
+
+/**
+ * Advance the program by one control tick. This is constant time.
+ *
+ * @param temperature Current block temperature.
+ * @param dt Seconds since the previous tick.
+ * @param p_setpoint Filled with the setpoint to use while running.
+ * @param p_fan Filled with the fan policy of the current step.
+ * @return true while a program is running (including PROFILE_DONE).
+ */
+extern bool profile_tick(float temperature, float dt, float *p_setpoint, profile_fan_t *p_fan);
+
+/**
+ * Get a snapshot of the program progress.
+ */
+extern void profile_get_status(profile_status_t *p_status);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__profile_h
+
+//=============================================================================
+// EOF profile.h
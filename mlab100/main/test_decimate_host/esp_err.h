@@ -0,0 +1,17 @@
+// esp_err.h
+//=============================================================================
+// The few esp-idf error codes used by the code under test, for host builds.
+
+#if !defined(__esp_err_h)
+#define __esp_err_h (1)
+
+typedef int esp_err_t;
+
+#define ESP_OK              (0)
+#define ESP_FAIL            (-1)
+#define ESP_ERR_INVALID_ARG (0x102)
+
+#endif // !__esp_err_h
+
+//=============================================================================
+// EOF esp_err.h
@@ -0,0 +1,205 @@
+// test_decimate.c
+//=============================================================================
+/*
+ * Host test and benchmark of the ADC stream decimator. The checks cover the
+ * argument limits, the DC gain and block independence; the benchmark times
+ * the filter configurations the firmware might use. Host figures are only
+ * useful to compare the configurations and spot regressions, they do not
+ * translate directly into ESP32 cycles.
+ */
+
+//=============================================================================
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "decimate.h"
+
+//-----------------------------------------------------------------------------
+
+static unsigned int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define TEST_SAMPLES (1024U)
+
+// a mild passband compensator (unity DC gain)
+static const int16_t test_fir[] = { -1024, 2048, 30720, 2048, -1024 };
+#define TEST_FIR_TAPS (sizeof(test_fir) / sizeof(test_fir[0]))
+
+static uint16_t input[TEST_SAMPLES];
+static int32_t output[TEST_SAMPLES];
+
+// a ramp with some LSB noise
+static void fill_ramp(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < TEST_SAMPLES; i++)
+        input[i] = (uint16_t)((2048 + (i & 0xFF) + ((i * 2654435761U) >> 31)) & 0x0FFF);
+}
+
+//-----------------------------------------------------------------------------
+
+static void test_init(void)
+{
+    decimate_t dec;
+
+    CHECK(ESP_ERR_INVALID_ARG == decimate_init(&dec,0,4,NULL,0));
+    CHECK(ESP_ERR_INVALID_ARG == decimate_init(&dec,(DECIMATE_ORDER_MAX + 1),4,NULL,0));
+    CHECK(ESP_ERR_INVALID_ARG == decimate_init(&dec,4,5,NULL,0)); // 20 bits of gain
+    CHECK(ESP_ERR_INVALID_ARG == decimate_init(&dec,3,4,test_fir,0));
+    CHECK(ESP_ERR_INVALID_ARG == decimate_init(&dec,3,4,test_fir,(DECIMATE_FIR_MAX + 1)));
+    CHECK(ESP_OK == decimate_init(&dec,1,4,NULL,0));
+    CHECK(ESP_OK == decimate_init(&dec,3,6,NULL,0));
+    CHECK(ESP_OK == decimate_init(&dec,1,0,NULL,0)); // a pass through
+}
+
+//-----------------------------------------------------------------------------
+
+// A constant input comes out unchanged, once the CIC and FIR have filled.
+static void check_dc(unsigned int order,unsigned int log2_ratio,const int16_t *p_fir,unsigned int fir_taps,uint16_t level)
+{
+    const unsigned int settle = ((order - 1) + fir_taps);
+    decimate_t dec;
+    size_t produced;
+    size_t i;
+
+    CHECK(ESP_OK == decimate_init(&dec,order,log2_ratio,p_fir,fir_taps));
+    for (i = 0; i < TEST_SAMPLES; i++)
+        input[i] = level;
+    produced = decimate_process(&dec,input,TEST_SAMPLES,output);
+    CHECK(produced == (TEST_SAMPLES >> log2_ratio));
+    for (i = settle; i < produced; i++)
+        CHECK(output[i] == ((int32_t)level << DECIMATE_FRAC_BITS));
+}
+
+static void test_dc(void)
+{
+    check_dc(1,4,NULL,0,1000);
+    check_dc(1,0,NULL,0,4095);
+    check_dc(3,4,NULL,0,4095);
+    check_dc(4,4,NULL,0,1);
+    check_dc(3,4,test_fir,TEST_FIR_TAPS,2048);
+}
+
+//-----------------------------------------------------------------------------
+
+// A boxcar outputs the block average.
+static void test_boxcar(void)
+{
+    decimate_t dec;
+    size_t produced;
+    size_t i;
+    unsigned int j;
+
+    fill_ramp();
+    CHECK(ESP_OK == decimate_init(&dec,1,4,NULL,0));
+    produced = decimate_process(&dec,input,TEST_SAMPLES,output);
+    CHECK(produced == (TEST_SAMPLES / 16));
+    for (i = 0; i < produced; i++) {
+        uint32_t sum = 0;
+        for (j = 0; j < 16; j++)
+            sum += input[(i * 16) + j];
+        CHECK(output[i] == (int32_t)(sum << (DECIMATE_FRAC_BITS - 4)));
+    }
+}
+
+// Splitting the input into odd sized blocks makes no difference.
+static void test_blocks(void)
+{
+    static int32_t whole[TEST_SAMPLES];
+    decimate_t dec;
+    size_t produced;
+    size_t count;
+    size_t n;
+
+    fill_ramp();
+    CHECK(ESP_OK == decimate_init(&dec,3,4,test_fir,TEST_FIR_TAPS));
+    produced = decimate_process(&dec,input,TEST_SAMPLES,whole);
+
+    decimate_reset(&dec);
+    count = 0;
+    for (n = 0; n < TEST_SAMPLES; n += 37) {
+        size_t block = (((TEST_SAMPLES - n) < 37) ? (TEST_SAMPLES - n) : 37);
+        count += decimate_process(&dec,&input[n],block,&output[count]);
+    }
+    CHECK(count == produced);
+    CHECK(0 == memcmp(whole,output,(produced * sizeof(output[0]))));
+}
+
+//-----------------------------------------------------------------------------
+/* The minimum of several runs is reported, to leave out scheduling noise. */
+
+#define BENCH_RUNS (64)
+
+static void bench(void)
+{
+    static const struct {
+        const char *p_name;
+        unsigned int order;
+        unsigned int log2_ratio;
+        bool fir;
+    } cases[] = {
+        { "boxcar R=16",     1, 4, false },
+        { "CIC3 R=16",       3, 4, false },
+        { "CIC3 R=16 + FIR", 3, 4, true  },
+        { "CIC3 R=64 + FIR", 3, 6, true  },
+    };
+    decimate_t dec;
+    unsigned int c;
+    unsigned int run;
+
+    fill_ramp();
+    for (c = 0; c < (sizeof(cases) / sizeof(cases[0])); c++) {
+        double best = 0.0;
+        size_t produced = 0;
+
+        if (ESP_OK != decimate_init(&dec,cases[c].order,cases[c].log2_ratio,(cases[c].fir ? test_fir : NULL),TEST_FIR_TAPS)) {
+            CHECK(false);
+            continue;
+        }
+        for (run = 0; run < BENCH_RUNS; run++) {
+            struct timespec start;
+            struct timespec end;
+            double ns;
+
+            clock_gettime(CLOCK_MONOTONIC,&start);
+            produced = decimate_process(&dec,input,TEST_SAMPLES,output);
+            clock_gettime(CLOCK_MONOTONIC,&end);
+            ns = (((end.tv_sec - start.tv_sec) * 1e9) + (end.tv_nsec - start.tv_nsec));
+            if ((0 == run) || (ns < best))
+                best = ns;
+        }
+
+        printf("%-16s %6.2f ns/input sample (%u outputs)\n",cases[c].p_name,(best / TEST_SAMPLES),(unsigned int)produced);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+int main(void)
+{
+    test_init();
+    test_dc();
+    test_boxcar();
+    test_blocks();
+    bench();
+
+    if (failures) {
+        printf("%u checks failed\n",failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
+
+//=============================================================================
+// EOF test_decimate.c
@@ -0,0 +1,22 @@
+// esp_timer.h
+//=============================================================================
+// The esp-idf microsecond clock used by the code under test, for host builds.
+
+#if !defined(__esp_timer_h)
+#define __esp_timer_h (1)
+
+#include <stdint.h>
+#include <time.h>
+
+static inline int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+}
+
+#endif // !__esp_timer_h
+
+//=============================================================================
+// EOF esp_timer.h
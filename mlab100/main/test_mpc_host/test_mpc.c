@@ -0,0 +1,207 @@
+// test_mpc.c
+//=============================================================================
+/*
+ * Host test of the predictive heater controller, and of its solve time.
+ *
+ * A simulated first-order-plus-dead-time block is fitted by the thermal
+ * estimator, starting from the wrong dead time, then the controller is
+ * checked for the obvious choices and for closing the loop on the block.
+ * The solve is timed over a grid of tracking errors and previous outputs,
+ * since the candidate pruning makes the time depend on the state, and the
+ * slowest case is reported. Host figures only compare changes to the
+ * solver; they are not ESP32 timings.
+ */
+
+//=============================================================================
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpc.h"
+
+//-----------------------------------------------------------------------------
+
+static unsigned int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// as used by mlab100.c
+#define TEST_LAMBDA         (0.995f)
+#define TEST_SWITCH_WEIGHT  (2.0f)
+#define TEST_ENERGY_WEIGHT  (0.01f)
+
+// the simulated block, in degrees above ambient per one second sample
+#define PLANT_A     (0.98f)
+#define PLANT_B     (2.0f)  // 100 degrees at full duty
+#define PLANT_C     (-0.5f)
+#define PLANT_DELAY (5)
+#define DELAY_GUESS (2)     // the estimator has to find PLANT_DELAY itself
+
+#define FIT_SAMPLES (600)
+
+typedef struct {
+    float y;
+    float u_history[PLANT_DELAY + 1];
+} plant_t;
+
+// Advance the block one sample with duty u now applied.
+static float plant_step(plant_t *p_plant,float u,float fan)
+{
+    unsigned int i;
+
+    for (i = PLANT_DELAY; i > 0; i--)
+        p_plant->u_history[i] = p_plant->u_history[i - 1];
+    p_plant->u_history[0] = u;
+    p_plant->y = ((PLANT_A * p_plant->y) + (PLANT_B * p_plant->u_history[PLANT_DELAY]) + (PLANT_C * fan));
+    return p_plant->y;
+}
+
+// Fit the estimator to the block driven by a pseudo-random duty and fan.
+static void fit(thermal_model_t *p_model,plant_t *p_plant)
+{
+    uint32_t lfsr = 0xACE1u;
+    float u = 0;
+    float fan = 0;
+    unsigned int k;
+
+    memset(p_plant,'\0',sizeof(*p_plant));
+    thermal_init(p_model,1.0f,DELAY_GUESS,TEST_LAMBDA);
+    for (k = 0; k < FIT_SAMPLES; k++) {
+        if (0 == (k % 8)) {
+            lfsr = ((lfsr >> 1) ^ (-(lfsr & 1u) & 0xB400u));
+            u = ((float)(lfsr & 0x7) / 7);
+            fan = (float)((lfsr >> 3) & 1);
+        }
+        thermal_update(p_model,p_plant->y,u,fan,1.0f);
+        plant_step(p_plant,u,fan);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static void test_fit(const thermal_model_t *p_model)
+{
+    CHECK(PLANT_DELAY == p_model->delay);
+    CHECK(fabsf(p_model->theta[0] - PLANT_A) < 0.005f);
+    CHECK(fabsf(p_model->theta[1] - PLANT_B) < 0.05f);
+    CHECK(fabsf(p_model->theta[2] - PLANT_C) < 0.05f);
+}
+
+static void test_choices(const thermal_model_t *p_model)
+{
+    mpc_t mpc;
+    float u, fan;
+
+    // far below the setpoint: full heat, no fan
+    mpc_init(&mpc,TEST_SWITCH_WEIGHT,TEST_ENERGY_WEIGHT);
+    mpc_solve(&mpc,p_model,0,60,&u,&fan);
+    CHECK(1.0f == u);
+    CHECK(0.0f == fan);
+
+    // far above: heater off
+    mpc_solve(&mpc,p_model,60,20,&u,&fan);
+    CHECK(0.0f == u);
+    CHECK(2 == mpc.solves);
+}
+
+// Close the loop on the simulated block, refitting as it goes.
+static void test_closed_loop(thermal_model_t *p_model,plant_t *p_plant)
+{
+    const float setpoint = 50;
+    mpc_t mpc;
+    float u = 0;
+    float fan = 0;
+    unsigned int k;
+
+    mpc_init(&mpc,TEST_SWITCH_WEIGHT,TEST_ENERGY_WEIGHT);
+    for (k = 0; k < 400; k++) {
+        thermal_update(p_model,p_plant->y,u,fan,1.0f);
+        mpc_solve(&mpc,p_model,p_plant->y,setpoint,&u,&fan);
+        plant_step(p_plant,u,fan);
+    }
+    CHECK(fabsf(p_plant->y - setpoint) < 1.0f);
+}
+
+//-----------------------------------------------------------------------------
+/* Each case restarts from the same controller state, so every solve takes
+   the same path; the minimum of the runs leaves out scheduling noise. */
+
+#define BENCH_SOLVES (2000)
+
+static void bench(const thermal_model_t *p_model)
+{
+    static const float errors[] = { -40, -10, -1, 0, 1, 10, 40 };
+    static const float last_u[] = { 0, 0.5f, 1 };
+    const float setpoint = 50;
+    double worst = 0;
+    float worst_error = 0, worst_u = 0, worst_fan = 0;
+    unsigned int e, l, f, n;
+
+    for (e = 0; e < (sizeof(errors) / sizeof(errors[0])); e++) {
+        for (l = 0; l < (sizeof(last_u) / sizeof(last_u[0])); l++) {
+            for (f = 0; f < MPC_FAN_LEVELS; f++) {
+                mpc_t initial;
+                double best = 0;
+
+                mpc_init(&initial,TEST_SWITCH_WEIGHT,TEST_ENERGY_WEIGHT);
+                initial.u = last_u[l];
+                initial.fan = ((float)f / (MPC_FAN_LEVELS - 1));
+
+                for (n = 0; n < BENCH_SOLVES; n++) {
+                    mpc_t mpc = initial;
+                    struct timespec start, end;
+                    float u, fan;
+                    double ns;
+
+                    clock_gettime(CLOCK_MONOTONIC,&start);
+                    mpc_solve(&mpc,p_model,(setpoint - errors[e]),setpoint,&u,&fan);
+                    clock_gettime(CLOCK_MONOTONIC,&end);
+                    ns = (((end.tv_sec - start.tv_sec) * 1e9) + (end.tv_nsec - start.tv_nsec));
+                    if ((0 == n) || (ns < best))
+                        best = ns;
+                }
+
+                if (best > worst) {
+                    worst = best;
+                    worst_error = errors[e];
+                    worst_u = initial.u;
+                    worst_fan = initial.fan;
+                }
+            }
+        }
+    }
+
+    printf("worst solve %.2f us (error %+.0f, last duty %.1f, last fan %.0f), at most %u model steps\n",(worst / 1000),worst_error,worst_u,worst_fan,(unsigned int)((MPC_DUTY_LEVELS + (2 * MPC_FINE_LEVELS)) * MPC_FAN_LEVELS * MPC_HORIZON));
+}
+
+//-----------------------------------------------------------------------------
+
+int main(void)
+{
+    thermal_model_t model;
+    plant_t plant;
+
+    fit(&model,&plant);
+    test_fit(&model);
+    test_choices(&model);
+    bench(&model);
+    test_closed_loop(&model,&plant);
+
+    if (failures) {
+        printf("%u checks failed\n",failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
+
+//=============================================================================
+// EOF test_mpc.c
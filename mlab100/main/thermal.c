@@ -0,0 +1,186 @@
+// thermal.c
+//=============================================================================
+/*
+ * Recursive least squares estimate of the heater block thermal model.
+ *
+ * Each sample the regressor from the previous sample predicts the change in
+ * temperature and the prediction error updates the estimate:
+ *
+ *   K = P phi / (lambda + phi' P phi)
+ *   theta += K (dy - phi' theta)
+ *   P = (P - K phi' P) / lambda
+ *
+ * The samples are not exactly periodic (the control loop runs late under
+ * load, and readings can fail), so the fit is of rates per second, with the
+ * regressor scaled by the measured interval. The discrete model handed to
+ * the predictor is the rate model taken over the nominal interval.
+ *
+ * The forgetting factor lets the estimate track changes in ambient and
+ * load. While the loop is not excited (e.g. holding steady) forgetting would
+ * let P grow without bound, so the covariance is only inflated while its
+ * trace is below THERMAL_P_TRACE_MAX.
+ *
+ * The dead time is not known in advance, so a bank of estimators is run, one
+ * per dead time from 0 to THERMAL_DELAY_MAX - 1, all fed the same samples.
+ * Each keeps a forgetting sum of its squared one-step prediction errors, and
+ * the model in use is the one with the lowest. A change of dead time needs a
+ * clear margin (THERMAL_SELECT_RATIO) so that the choice does not flap while
+ * the loop is not excited and every candidate predicts about as well.
+ */
+
+//=============================================================================
+
+#include <math.h>
+#include <string.h>
+
+#include "thermal.h"
+
+//-----------------------------------------------------------------------------
+
+#define THERMAL_P_INITIAL     (100.0f)  // low confidence in the initial estimate
+#define THERMAL_P_TRACE_MAX   (1.0e4f)  // covariance windup limit
+#define THERMAL_SELECT_UPDATES (THERMAL_DELAY_MAX) // samples fitted before the dead time is chosen
+#define THERMAL_SELECT_RATIO  (0.9f)    // cost of a new dead time relative to the current one
+
+//-----------------------------------------------------------------------------
+
+void thermal_init(thermal_model_t *p_model,float dt,unsigned int delay,float lambda)
+{
+    unsigned int d, i;
+
+    memset(p_model, 0, sizeof(*p_model));
+    p_model->dt = dt;
+    p_model->delay = ((delay < THERMAL_DELAY_MAX) ? delay : (THERMAL_DELAY_MAX - 1));
+    p_model->lambda = lambda;
+
+    // start from "temperature holds" (no rates), with no heater or fan effect known
+    for (d = 0; d < THERMAL_DELAY_MAX; d++) {
+        for (i = 0; i < THERMAL_PARAMS; i++)
+            p_model->candidates[d].P[i][i] = THERMAL_P_INITIAL;
+    }
+    p_model->theta[0] = 1.0f;
+}
+
+//-----------------------------------------------------------------------------
+
+// One recursive least squares step of a candidate, returning the prediction error
+
+static float thermal_fit(thermal_candidate_t *p_cand,const float *p_phi,float y,float lambda)
+{
+    float Pphi[THERMAL_PARAMS];
+    float K[THERMAL_PARAMS];
+    float denom, error, trace, scale;
+    unsigned int i, j;
+
+    denom = lambda;
+    error = y;
+    for (i = 0; i < THERMAL_PARAMS; i++) {
+        Pphi[i] = 0;
+        for (j = 0; j < THERMAL_PARAMS; j++)
+            Pphi[i] += (p_cand->P[i][j] * p_phi[j]);
+        denom += (p_phi[i] * Pphi[i]);
+        error -= (p_phi[i] * p_cand->theta[i]);
+    }
+
+    for (i = 0; i < THERMAL_PARAMS; i++) {
+        K[i] = (Pphi[i] / denom);
+        p_cand->theta[i] += (K[i] * error);
+    }
+
+    trace = 0;
+    for (i = 0; i < THERMAL_PARAMS; i++)
+        trace += p_cand->P[i][i];
+    scale = ((trace < THERMAL_P_TRACE_MAX) ? (1.0f / lambda) : 1.0f);
+
+    // P is symmetric, so K phi' P == K (P phi)'; keep it exactly symmetric
+    for (i = 0; i < THERMAL_PARAMS; i++) {
+        for (j = i; j < THERMAL_PARAMS; j++) {
+            float v = ((p_cand->P[i][j] - (K[i] * Pphi[j])) * scale);
+            p_cand->P[i][j] = v;
+            p_cand->P[j][i] = v;
+        }
+    }
+
+    p_cand->cost = ((lambda * p_cand->cost) + (error * error));
+    return error;
+}
+
+//-----------------------------------------------------------------------------
+
+void thermal_update(thermal_model_t *p_model,float y,float u,float fan,float dt)
+{
+    float errors[THERMAL_DELAY_MAX];
+    float phi[THERMAL_PARAMS];
+    const float *p_rate;
+    unsigned int best;
+    unsigned int d;
+
+    if (p_model->primed && (dt > 0)) {
+        // the regressors differ only in how long ago the duty was applied
+        phi[0] = (p_model->y_last * dt);
+        phi[2] = (p_model->fan_last * dt);
+        phi[3] = dt;
+        best = p_model->delay;
+        for (d = 0; d < THERMAL_DELAY_MAX; d++) {
+            phi[1] = (thermal_past_input(p_model, d) * dt);
+            errors[d] = thermal_fit(&p_model->candidates[d], phi, (y - p_model->y_last), p_model->lambda);
+            if (p_model->candidates[d].cost < p_model->candidates[best].cost)
+                best = d;
+        }
+        p_model->updates++;
+
+        if ((p_model->updates >= THERMAL_SELECT_UPDATES) && (p_model->candidates[best].cost < (THERMAL_SELECT_RATIO * p_model->candidates[p_model->delay].cost)))
+            p_model->delay = best;
+
+        p_rate = p_model->candidates[p_model->delay].theta;
+        p_model->theta[0] = (1.0f + (p_rate[0] * p_model->dt));
+        p_model->theta[1] = (p_rate[1] * p_model->dt);
+        p_model->theta[2] = (p_rate[2] * p_model->dt);
+        p_model->theta[3] = (p_rate[3] * p_model->dt);
+        p_model->residual = errors[p_model->delay];
+    }
+
+    // the duty applied now only reaches the regressor after the dead time
+    p_model->u_history[p_model->head] = u;
+    p_model->head = ((p_model->head + 1) % THERMAL_DELAY_MAX);
+
+    p_model->y_last = y;
+    p_model->fan_last = fan;
+    p_model->primed = true;
+}
+
+//-----------------------------------------------------------------------------
+
+float thermal_predict(const thermal_model_t *p_model,float y,float u_delayed,float fan)
+{
+    return ((p_model->theta[0] * y) + (p_model->theta[1] * u_delayed) + (p_model->theta[2] * fan) + p_model->theta[3]);
+}
+
+//-----------------------------------------------------------------------------
+
+float thermal_past_input(const thermal_model_t *p_model,unsigned int age)
+{
+    if (age >= THERMAL_DELAY_MAX)
+        return 0;
+    return p_model->u_history[(p_model->head + THERMAL_DELAY_MAX - 1 - age) % THERMAL_DELAY_MAX];
+}
+
+//-----------------------------------------------------------------------------
+
+bool thermal_get_params(const thermal_model_t *p_model,thermal_params_t *p_params)
+{
+    float a = p_model->theta[0];
+
+    if ((a <= 0) || (a >= 1))
+        return false;
+
+    p_params->tau = (-p_model->dt / logf(a));
+    p_params->gain = (p_model->theta[1] / (1 - a));
+    p_params->fan_gain = (p_model->theta[2] / (1 - a));
+    p_params->offset = (p_model->theta[3] / (1 - a));
+    p_params->dead_time = (p_model->delay * p_model->dt);
+    return true;
+}
+
+//=============================================================================
+// EOF thermal.c
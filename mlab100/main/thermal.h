@@ -0,0 +1,133 @@
+// thermal.h
+//=============================================================================
+
+#if !defined(__thermal_h)
+#define __thermal_h (1)
+
+//-----------------------------------------------------------------------------
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#define THERMAL_PARAMS      (4)  // y[k], u[k-d], fan[k], 1
+#define THERMAL_DELAY_MAX   (32) // dead time limit in samples
+
+// One estimator of the bank, for a single dead time
+typedef struct {
+    float theta[THERMAL_PARAMS];                // a, b, c, e as rates per second
+    float P[THERMAL_PARAMS][THERMAL_PARAMS];    // estimate covariance
+    float cost;                                 // forgetting sum of squared prediction errors
+} thermal_candidate_t;
+
+/* Online estimate of a first-order-plus-dead-time model of the heater block,
+   in discrete form:
+
+     y[k+1] = a * y[k] + b * u[k-d] + c * fan[k] + e
+
+   with the heater duty u and fan drive as fractions 0..1, at the nominal
+   sample interval dt. It is fitted as rates over the measured interval h,
+
+     y[k+1] - y[k] = h * (a' * y[k] + b' * u[k-d] + c' * fan[k] + e')
+
+   so that late samples do not bias it; a = 1 + a' * dt, b = b' * dt etc.
+   The dead time d is estimated too: every d from 0 to THERMAL_DELAY_MAX - 1
+   has its own estimator, and the one predicting best is used. */
+typedef struct {
+    float theta[THERMAL_PARAMS];                // a, b, c, e at the selected dead time
+    float lambda;                               // forgetting factor
+    float dt;                                   // nominal sample interval in seconds
+    float u_history[THERMAL_DELAY_MAX];         // past duty, for the dead time
+    unsigned int delay;                         // selected dead time in samples
+    unsigned int head;
+    float y_last;                               // regressor from the previous sample
+    float fan_last;
+    bool primed;                                // y_last and fan_last are valid
+    uint32_t updates;                           // samples fitted
+    float residual;                             // last one-step prediction error
+    thermal_candidate_t candidates[THERMAL_DELAY_MAX]; // indexed by dead time
+} thermal_model_t;
+
+// Continuous-time view of the current estimate
+typedef struct {
+    float tau;          // time constant in seconds
+    float gain;         // steady-state degrees per unit duty
+    float fan_gain;     // steady-state degrees for the fan fully on
+    float offset;       // steady-state temperature with heater and fan off
+    float dead_time;    // seconds
+} thermal_params_t;
+
+//-----------------------------------------------------------------------------
+/**
+ * Initialise the estimator.
+ *
+ * @param p_model Model state.
+ * @param dt Nominal sample interval in seconds.
+ * @param delay Initial dead time in samples (up to THERMAL_DELAY_MAX - 1),
+ *        used until the fit shows a better one.
+ * @param lambda Forgetting factor, e.g. 0.995 for a memory of ~200 samples.
+ */
+extern void thermal_init(thermal_model_t *p_model, float dt, unsigned int delay, float lambda);
+
+/**
+ * Fit one sample with recursive least squares, for every candidate dead
+ * time, and select the dead time with the lowest recent prediction error.
+ * This is constant time and should be called once per sample interval.
+ *
+ * @param p_model Model state.
+ * @param y Measured temperature.
+ * @param u Heater duty being applied from now (0..1).
+ * @param fan Fan drive being applied from now (0..1).
+ * @param dt Measured seconds since the previous call, or 0 if the samples
+ *        are not consecutive (the fit is skipped but the history kept).
+ */
+extern void thermal_update(thermal_model_t *p_model, float y, float u, float fan, float dt);
+
+/**
+ * Predict the temperature one sample ahead.
+ *
+ * @param p_model Model state.
+ * @param y Current temperature.
+ * @param u_delayed Heater duty applied dead-time samples ago (0..1).
+ * @param fan Fan drive (0..1).
+ * @return predicted temperature.
+ */
+extern float thermal_predict(const thermal_model_t *p_model, float y, float u_delayed, float fan);
+
+/**
+ * Get a heater duty previously passed to thermal_update().
+ *
+ * @param p_model Model state.
+ * @param age 0 for the most recent duty, 1 for the one before, etc.
+ * @return duty (0..1), or 0 beyond the recorded history.
+ */
+extern float thermal_past_input(const thermal_model_t *p_model, unsigned int age);
+
+/**
+ * Get the physical parameters of the current estimate.
+ *
+ * @param p_model Model state.
+ * @param p_params Filled with the parameters.
+ * @return false if the estimate is not (yet) a stable first-order lag.
+ */
+extern bool thermal_get_params(const thermal_model_t *p_model, thermal_params_t *p_params);
+
+//-----------------------------------------------------------------------------
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+//-----------------------------------------------------------------------------
+
+#endif // !__thermal_h
+
+//=============================================================================
+// EOF thermal.h